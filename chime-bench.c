@@ -0,0 +1,218 @@
+/*
+ * End-to-end libchime benchmark against the local mock service in
+ * chime-mock.c. Connects, reports how long it took to come online and the
+ * memory high-water mark, then counts Juggernaut pushes dispatched to
+ * conversations, rooms and contacts for a while.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "chime/chime-connection.h"
+#include "chime/chime-contact.h"
+#include "chime/chime-conversation.h"
+#include "chime/chime-room.h"
+
+static gchar *opt_server = "http://127.0.0.1:8080/";
+static gint opt_duration = 10;
+static gint opt_watch = 1000;
+static gboolean opt_warm;
+static gboolean opt_stats;
+
+static GOptionEntry options[] = {
+	{ "server", 's', 0, G_OPTION_ARG_STRING, &opt_server, "Mock service URL (default http://127.0.0.1:8080/)", "URL" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration, "Seconds to count pushes for (default 10)", "SECS" },
+	{ "watch", 'w', 0, G_OPTION_ARG_INT, &opt_watch, "Contacts to watch for presence (default 1000)", "N" },
+	{ "warm", 0, 0, G_OPTION_ARG_NONE, &opt_warm, "Use the HTTP cache from a previous run", NULL },
+	{ "stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats, "Dump per-endpoint request and per-channel push statistics", NULL },
+	{ NULL }
+};
+
+static GMainLoop *loop;
+static int status;
+
+static gint64 start_time;
+static gint nr_contacts, nr_rooms, nr_convs, nr_watched;
+
+static gboolean counting;
+static guint64 conv_msgs, room_msgs, presences;
+static gint64 count_start;
+static struct rusage count_ru;
+
+/* Peak resident set size, from /proc */
+static glong vm_hwm_kb(void)
+{
+	gchar *status_txt = NULL, *p;
+	glong kb = -1;
+
+	if (g_file_get_contents("/proc/self/status", &status_txt, NULL, NULL) &&
+	    (p = strstr(status_txt, "VmHWM:")))
+		kb = strtol(p + 6, NULL, 10);
+
+	g_free(status_txt);
+	return kb;
+}
+
+static gint64 cpu_usec(struct rusage *ru)
+{
+	return (gint64)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * G_USEC_PER_SEC +
+		ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
+static void conv_message(ChimeConversation *conv, JsonNode *record, gpointer _unused)
+{
+	if (counting)
+		conv_msgs++;
+}
+
+static void room_mention(ChimeConnection *cxn, ChimeRoom *room, JsonNode *record, gpointer _unused)
+{
+	if (counting)
+		room_msgs++;
+}
+
+static void availability_changed(ChimeContact *contact, GParamSpec *pspec, gpointer _unused)
+{
+	if (counting)
+		presences++;
+}
+
+static void new_contact(ChimeConnection *cxn, ChimeContact *contact, gpointer _unused)
+{
+	nr_contacts++;
+
+	/* Asking for the availability subscribes to presence updates */
+	if (nr_watched < opt_watch) {
+		nr_watched++;
+		g_signal_connect(contact, "notify::availability",
+				 G_CALLBACK(availability_changed), NULL);
+		chime_contact_get_availability(contact);
+	}
+}
+
+static void new_room(ChimeConnection *cxn, ChimeRoom *room, gpointer _unused)
+{
+	nr_rooms++;
+}
+
+static void new_conversation(ChimeConnection *cxn, ChimeConversation *conv, gpointer _unused)
+{
+	nr_convs++;
+	g_signal_connect(conv, "message", G_CALLBACK(conv_message), NULL);
+}
+
+static void dump_json(JsonNode *node)
+{
+	JsonGenerator *gen = json_generator_new();
+	gchar *data;
+
+	json_generator_set_root(gen, node);
+	json_generator_set_pretty(gen, TRUE);
+	data = json_generator_to_data(gen, NULL);
+	printf("%s\n", data);
+
+	g_free(data);
+	g_object_unref(gen);
+	json_node_unref(node);
+}
+
+static void dump_stats(ChimeConnection *cxn)
+{
+	dump_json(chime_connection_get_request_stats(cxn));
+	dump_json(chime_connection_get_jugg_stats(cxn));
+}
+
+static gboolean finish_counting(gpointer _cxn)
+{
+	ChimeConnection *cxn = _cxn;
+	gint64 elapsed = g_get_monotonic_time() - count_start;
+	guint64 total = conv_msgs + room_msgs + presences;
+	struct rusage ru;
+	gint64 cpu;
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = cpu_usec(&ru) - cpu_usec(&count_ru);
+	counting = FALSE;
+
+	printf("Dispatched %" G_GUINT64_FORMAT " pushes in %.2fs: %.1f/s "
+	       "(%" G_GUINT64_FORMAT " conversation, %" G_GUINT64_FORMAT " room, "
+	       "%" G_GUINT64_FORMAT " presence)\n",
+	       total, elapsed / 1000000.0, total * 1000000.0 / elapsed,
+	       conv_msgs, room_msgs, presences);
+	printf("CPU time: %.2fs, %.1fus per push\n", cpu / 1000000.0,
+	       total ? (double)cpu / total : 0.0);
+	printf("Memory high-water mark: %ld kB\n", vm_hwm_kb());
+
+	if (opt_stats)
+		dump_stats(cxn);
+
+	chime_connection_disconnect(cxn);
+	return G_SOURCE_REMOVE;
+}
+
+static void connected(ChimeConnection *cxn, const gchar *display_name, gpointer _unused)
+{
+	gint64 elapsed = g_get_monotonic_time() - start_time;
+
+	printf("Online as %s after %.3fs\n", display_name, elapsed / 1000000.0);
+	printf("%d contacts, %d rooms, %d conversations\n", nr_contacts, nr_rooms, nr_convs);
+	printf("Memory high-water mark: %ld kB\n", vm_hwm_kb());
+	fflush(stdout);
+
+	counting = TRUE;
+	count_start = g_get_monotonic_time();
+	getrusage(RUSAGE_SELF, &count_ru);
+	g_timeout_add_seconds(opt_duration, finish_counting, cxn);
+}
+
+static void disconnected(ChimeConnection *cxn, GError *error, gpointer _unused)
+{
+	if (error) {
+		fprintf(stderr, "ERROR: %s\n", error->message);
+		status = EXIT_FAILURE;
+	}
+	if (g_main_loop_is_running(loop))
+		g_main_loop_quit(loop);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *ctx;
+	GError *error = NULL;
+	ChimeConnection *cxn;
+
+	ctx = g_option_context_new("- benchmark libchime against chime-mock");
+	g_option_context_add_main_entries(ctx, options, NULL);
+	if (!g_option_context_parse(ctx, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(ctx);
+
+	/* Measure a cold start unless asked not to */
+	if (!opt_warm)
+		g_setenv("CHIME_NO_HTTP_CACHE", "1", TRUE);
+
+	loop = g_main_loop_new(NULL, FALSE);
+	status = EXIT_SUCCESS;
+
+	cxn = chime_connection_new("bench@example.com", opt_server, "bench-device",
+				   "bench-session-token");
+
+	g_signal_connect(cxn, "connected", G_CALLBACK(connected), NULL);
+	g_signal_connect(cxn, "disconnected", G_CALLBACK(disconnected), NULL);
+	g_signal_connect(cxn, "new-contact", G_CALLBACK(new_contact), NULL);
+	g_signal_connect(cxn, "new-room", G_CALLBACK(new_room), NULL);
+	g_signal_connect(cxn, "new-conversation", G_CALLBACK(new_conversation), NULL);
+	g_signal_connect(cxn, "room-mention", G_CALLBACK(room_mention), NULL);
+
+	start_time = g_get_monotonic_time();
+	chime_connection_connect(cxn);
+	g_main_loop_run(loop);
+
+	g_object_unref(cxn);
+	g_main_loop_unref(loop);
+	return status;
+}
@@ -0,0 +1,108 @@
+/*
+ * Microbenchmark for WebSocket payload masking. Checks each implementation
+ * usable on this CPU against the byte-at-a-time one, at every alignment,
+ * then reports the throughput of each over a range of frame sizes.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chime/chime-websocket-mask.h"
+
+static gint opt_millisecs = 200;
+static gint opt_max = 1 << 20;
+
+static GOptionEntry options[] = {
+	{ "time", 't', 0, G_OPTION_ARG_INT, &opt_millisecs, "Milliseconds to run each size for (default 200)", "MS" },
+	{ "max", 'm', 0, G_OPTION_ARG_INT, &opt_max, "Largest frame size (default 1048576)", "BYTES" },
+	{ NULL }
+};
+
+static const guint8 mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+static gboolean check(const gchar *impl)
+{
+	guint8 ref[300], buf[300 + 32];
+	gsize len, align, i;
+
+	for (len = 0; len < sizeof(ref); len++) {
+		for (align = 0; align < 32; align++) {
+			for (i = 0; i < len; i++)
+				ref[i] = buf[align + i] = g_random_int();
+
+			for (i = 0; i < len; i++)
+				ref[i] ^= mask[i & 3];
+			chime_websocket_mask_with(impl, mask, buf + align, len);
+
+			if (memcmp(ref, buf + align, len)) {
+				fprintf(stderr, "%s: wrong result for length %" G_GSIZE_FORMAT
+					" at offset %" G_GSIZE_FORMAT "\n", impl, len, align);
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/* MB/s masking @len bytes repeatedly for about opt_millisecs */
+static double run(const gchar *impl, guint8 *buf, gsize len)
+{
+	gint64 start = g_get_monotonic_time(), elapsed;
+	guint64 done = 0;
+	guint i;
+
+	do {
+		/* Enough rounds between clock reads that they don't count */
+		for (i = 0; i < 64; i++)
+			chime_websocket_mask_with(impl, mask, buf, len);
+		done += 64 * len;
+		elapsed = g_get_monotonic_time() - start;
+	} while (elapsed < opt_millisecs * 1000);
+
+	return (double)done / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *ctx;
+	GError *error = NULL;
+	const gchar * const *impls;
+	guint8 *buf;
+	gsize len;
+	int i;
+
+	ctx = g_option_context_new("- benchmark WebSocket masking");
+	g_option_context_add_main_entries(ctx, options, NULL);
+	if (!g_option_context_parse(ctx, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(ctx);
+
+	impls = chime_websocket_mask_impls();
+	for (i = 0; impls[i]; i++) {
+		if (!check(impls[i]))
+			return EXIT_FAILURE;
+	}
+
+	/* Deliberately misaligned, as a payload after a frame header is */
+	buf = g_malloc0(opt_max + 2);
+
+	printf("%10s", "bytes");
+	for (i = 0; impls[i]; i++)
+		printf(" %10s", impls[i]);
+	printf("   (MB/s)\n");
+
+	for (len = 16; len <= (gsize)opt_max; len *= 4) {
+		printf("%10" G_GSIZE_FORMAT, len);
+		for (i = 0; impls[i]; i++) {
+			printf(" %10.0f", run(impls[i], buf + 2, len));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	g_free(buf);
+	return EXIT_SUCCESS;
+}
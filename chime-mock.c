@@ -0,0 +1,576 @@
+/*
+ * Minimal local stand-in for the Chime service, for benchmarking libchime
+ * without a real account. It serves the registration, contacts, rooms,
+ * conversations, messages, presence and meetings endpoints with synthetic
+ * data, and a Juggernaut WebSocket which pushes messages and presence
+ * updates at a configurable rate.
+ *
+ * Only plain HTTP on the loopback interface is supported; point libchime
+ * at the URL it prints (see chime-bench.c).
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
+
+#define KIND_SELF	0
+#define KIND_CONTACT	1
+#define KIND_ROOM	2
+#define KIND_CONV	3
+#define KIND_MSG	4
+
+#define PUSH_TICK_MS	10
+
+static gint opt_port = 8080;
+static gint opt_contacts = 5000;
+static gint opt_rooms = 2000;
+static gint opt_convs = 500;
+static gint opt_history = 50;
+static gint opt_page = 500;
+static gint opt_rate = 100;
+static gboolean opt_verbose;
+
+static GOptionEntry options[] = {
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &opt_port, "Port to listen on (default 8080)", "PORT" },
+	{ "contacts", 'c', 0, G_OPTION_ARG_INT, &opt_contacts, "Number of contacts (default 5000)", "N" },
+	{ "rooms", 'r', 0, G_OPTION_ARG_INT, &opt_rooms, "Number of rooms (default 2000)", "N" },
+	{ "conversations", 'C', 0, G_OPTION_ARG_INT, &opt_convs, "Number of conversations (default 500)", "N" },
+	{ "history", 'H', 0, G_OPTION_ARG_INT, &opt_history, "Messages returned per room or conversation (default 50)", "N" },
+	{ "page-size", 0, 0, G_OPTION_ARG_INT, &opt_page, "Contacts per page (default 500)", "N" },
+	{ "rate", 'R', 0, G_OPTION_ARG_INT, &opt_rate, "Juggernaut pushes per second (default 100)", "N" },
+	{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Log requests", NULL },
+	{ NULL }
+};
+
+static gchar *base_url;
+static gchar *now_str;
+static gchar *self_id, *self_presence, *device_channel;
+
+/* Only one client at a time */
+static SoupWebsocketConnection *ws_conn;
+static GHashTable *subscribed;
+static GPtrArray *presence_subs;
+static guint push_timer;
+static gint64 push_start;
+static guint64 pushes_sent, acks_seen, push_seq;
+
+static gchar *mock_id(guint kind, guint n)
+{
+	return g_strdup_printf("%08x-0000-4000-8000-%012x", kind, n);
+}
+
+static void set_json_response(SoupMessage *msg, GString *body)
+{
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, "application/json", SOUP_MEMORY_TAKE,
+				  body->str, body->len);
+	g_string_free(body, FALSE);
+}
+
+/* The data never changes, so any validator we handed out is still good */
+static gboolean check_etag(SoupMessage *msg)
+{
+	const gchar *inm = soup_message_headers_get_one(msg->request_headers, "If-None-Match");
+
+	soup_message_headers_replace(msg->response_headers, "ETag", "\"mock-1\"");
+	if (inm && !strcmp(inm, "\"mock-1\"")) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_MODIFIED);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static guint query_uint(GHashTable *query, const gchar *key, guint dflt)
+{
+	const gchar *val = query ? g_hash_table_lookup(query, key) : NULL;
+
+	return val ? strtoul(val, NULL, 10) : dflt;
+}
+
+static void append_member(GString *s, guint kind, guint n)
+{
+	gchar *id = mock_id(kind, n);
+
+	g_string_append_printf(s, "{\"Email\":\"user%u@example.com\",\"FullName\":\"User %u\","
+			       "\"PresenceChannel\":\"profile_presence!%s\",\"DisplayName\":\"User %u\","
+			       "\"ProfileId\":\"%s\"}", n, n, id, n, id);
+	g_free(id);
+}
+
+static void append_notify_prefs(GString *s)
+{
+	g_string_append(s, "\"Preferences\":{\"NotificationPreferences\":{"
+			"\"DesktopNotificationPreferences\":\"always\","
+			"\"MobileNotificationPreferences\":\"always\"}}");
+}
+
+static void append_message(GString *s, const gchar *parent_key, const gchar *parent_id,
+			   guint n, const gchar *time)
+{
+	gchar *msg_id = mock_id(KIND_MSG, n);
+	gchar *sender = mock_id(KIND_CONTACT, n % MAX(opt_contacts, 1));
+
+	g_string_append_printf(s, "{\"MessageId\":\"%s\",\"%s\":\"%s\",\"Sender\":\"%s\","
+			       "\"Content\":\"Synthetic message %u\",\"CreatedOn\":\"%s\","
+			       "\"UpdatedOn\":\"%s\"}",
+			       msg_id, parent_key, parent_id, sender, n, time, time);
+	g_free(sender);
+	g_free(msg_id);
+}
+
+static void sessions_cb(SoupServer *server, SoupMessage *msg, const char *path,
+			GHashTable *query, SoupClientContext *client, gpointer _unused)
+{
+	GString *s = g_string_new(NULL);
+
+	g_string_append_printf(s, "{\"Session\":{\"SessionToken\":\"mock-session-token\","
+			       "\"SessionId\":\"%s\","
+			       "\"Profile\":{\"profile_channel\":\"profile!%s\","
+			       "\"presence_channel\":\"profile_presence!%s\",\"id\":\"%s\","
+			       "\"display_name\":\"Bench User\",\"email\":\"bench@example.com\"},"
+			       "\"Device\":{\"DeviceId\":\"%s\",\"Channel\":\"device!%s\"},"
+			       "\"ServiceConfig\":{"
+			       "\"Presence\":{\"RestUrl\":\"%spresence\"},"
+			       "\"Push\":{\"ReachabilityUrl\":\"%sreachability\",\"WebsocketUrl\":\"%spush\"},"
+			       "\"Profile\":{\"RestUrl\":\"%sprofile\"},"
+			       "\"Contacts\":{\"RestUrl\":\"%scontacts\"},"
+			       "\"Messaging\":{\"RestUrl\":\"%smessaging\"},"
+			       "\"Conference\":{\"RestUrl\":\"%sconference\"},"
+			       "\"Feature\":{\"RestUrl\":\"%sfeature\"}}}}",
+			       self_id, self_id, self_id, self_id, self_id, self_id,
+			       base_url, base_url, base_url, base_url, base_url,
+			       base_url, base_url, base_url);
+	set_json_response(msg, s);
+}
+
+/* Token renewal */
+static void profile_cb(SoupServer *server, SoupMessage *msg, const char *path,
+		       GHashTable *query, SoupClientContext *client, gpointer _unused)
+{
+	if (strcmp(path, "/profile/tokens")) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+	set_json_response(msg, g_string_new("{\"SessionToken\":\"mock-session-token\"}"));
+}
+
+/* Contacts come as a bare array, paged with a header */
+static void contacts_cb(SoupServer *server, SoupMessage *msg, const char *path,
+			GHashTable *query, SoupClientContext *client, gpointer _unused)
+{
+	guint start = query_uint(query, "next_token", 0);
+	guint end = MIN(start + MAX(opt_page, 1), (guint)opt_contacts);
+	GString *s;
+	guint i;
+
+	if (strcmp(path, "/contacts/contacts")) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+	if (check_etag(msg))
+		return;
+
+	s = g_string_new("[");
+	for (i = start; i < end; i++) {
+		gchar *id = mock_id(KIND_CONTACT, i);
+
+		if (i > start)
+			g_string_append_c(s, ',');
+		g_string_append_printf(s, "{\"email\":\"user%u@example.com\",\"full_name\":\"User %u\","
+				       "\"display_name\":\"User %u\",\"id\":\"%s\","
+				       "\"presence_channel\":\"profile_presence!%s\","
+				       "\"profile_channel\":\"profile!%s\"}",
+				       i, i, i, id, id, id);
+		g_free(id);
+	}
+	g_string_append_c(s, ']');
+
+	if (end < (guint)opt_contacts) {
+		gchar *next = g_strdup_printf("%u", end);
+		soup_message_headers_replace(msg->response_headers, "aws-ucbuzz-nexttoken", next);
+		g_free(next);
+	}
+	set_json_response(msg, s);
+}
+
+/* Rooms and conversations use the same object-with-NextToken paging */
+static void list_page(SoupMessage *msg, GHashTable *query, const gchar *member,
+		      guint total, void (*append)(GString *, guint))
+{
+	guint start = query_uint(query, "next-token", 0);
+	guint end = MIN(start + MAX(query_uint(query, "max-results", 50), 1), total);
+	GString *s;
+	guint i;
+
+	if (check_etag(msg))
+		return;
+
+	s = g_string_new(NULL);
+	g_string_append_printf(s, "{\"%s\":[", member);
+	for (i = start; i < end; i++) {
+		if (i > start)
+			g_string_append_c(s, ',');
+		append(s, i);
+	}
+	if (end < total)
+		g_string_append_printf(s, "],\"NextToken\":\"%u\"}", end);
+	else
+		g_string_append(s, "],\"NextToken\":null}");
+
+	set_json_response(msg, s);
+}
+
+static void append_room(GString *s, guint n)
+{
+	gchar *id = mock_id(KIND_ROOM, n);
+
+	g_string_append_printf(s, "{\"RoomId\":\"%s\",\"Name\":\"Room %u\",\"Privacy\":\"%s\","
+			       "\"Type\":\"standard\",\"Visibility\":\"visible\",\"Open\":true,"
+			       "\"Channel\":\"room!%s\",\"CreatedOn\":\"%s\",\"UpdatedOn\":\"%s\",",
+			       id, n, (n & 1) ? "public" : "private", id, now_str, now_str);
+	append_notify_prefs(s);
+	g_string_append_c(s, '}');
+	g_free(id);
+}
+
+static void append_conv(GString *s, guint n)
+{
+	gchar *id = mock_id(KIND_CONV, n);
+
+	g_string_append_printf(s, "{\"ConversationId\":\"%s\",\"Name\":\"\",\"Visibility\":\"visible\","
+			       "\"Favorite\":false,\"Channel\":\"conversation!%s\","
+			       "\"CreatedOn\":\"%s\",\"UpdatedOn\":\"%s\",\"Members\":[",
+			       id, id, now_str, now_str);
+	append_member(s, KIND_CONTACT, n % MAX(opt_contacts, 1));
+	g_string_append(s, "],");
+	append_notify_prefs(s);
+	g_string_append_c(s, '}');
+	g_free(id);
+}
+
+static void messages_page(SoupMessage *msg, GHashTable *query, const gchar *parent_key,
+			  const gchar *parent_id)
+{
+	guint count = MIN(query_uint(query, "max-results", 50), (guint)opt_history);
+	GString *s = g_string_new("{\"Messages\":[");
+	guint i;
+
+	for (i = 0; i < count; i++) {
+		if (i)
+			g_string_append_c(s, ',');
+		append_message(s, parent_key, parent_id, i, now_str);
+	}
+	g_string_append(s, "],\"NextToken\":null}");
+	set_json_response(msg, s);
+}
+
+static void messaging_cb(SoupServer *server, SoupMessage *msg, const char *path,
+			 GHashTable *query, SoupClientContext *client, gpointer _unused)
+{
+	gchar **parts = g_strsplit(path, "/", 0);
+	guint n = g_strv_length(parts);
+
+	/* parts[0] is empty, parts[1] is "messaging" */
+	if (msg->method != SOUP_METHOD_GET || n < 3) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+	} else if (n == 3 && !strcmp(parts[2], "rooms")) {
+		list_page(msg, query, "Rooms", opt_rooms, append_room);
+	} else if (n == 3 && !strcmp(parts[2], "conversations")) {
+		list_page(msg, query, "Conversations", opt_convs, append_conv);
+	} else if (n == 5 && !strcmp(parts[4], "messages")) {
+		messages_page(msg, query, !strcmp(parts[2], "rooms") ? "RoomId" : "ConversationId",
+			      parts[3]);
+	} else {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+	}
+	g_strfreev(parts);
+}
+
+static void presence_cb(SoupServer *server, SoupMessage *msg, const char *path,
+			GHashTable *query, SoupClientContext *client, gpointer _unused)
+{
+	const gchar *ids = query ? g_hash_table_lookup(query, "profile-ids") : NULL;
+
+	if (!strcmp(path, "/presence/presence") && ids) {
+		gchar **id = g_strsplit(ids, ",", 0);
+		GString *s = g_string_new("{\"Presences\":[");
+		int i;
+
+		for (i = 0; id[i]; i++)
+			g_string_append_printf(s, "%s{\"ProfileId\":\"%s\",\"Revision\":1,\"Availability\":%d}",
+					       i ? "," : "", id[i], 1 + (i % 4));
+		g_string_append(s, "]}");
+		g_strfreev(id);
+		set_json_response(msg, s);
+	} else {
+		/* devicestatus, presencesettings */
+		set_json_response(msg, g_string_new("{}"));
+	}
+}
+
+static void conference_cb(SoupServer *server, SoupMessage *msg, const char *path,
+			  GHashTable *query, SoupClientContext *client, gpointer _unused)
+{
+	if (strcmp(path, "/conference/joinable_meetings")) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+	if (!check_etag(msg))
+		set_json_response(msg, g_string_new("[]"));
+}
+
+/* socket.io handshake: key, heartbeat and close timeouts, transports */
+static void push_cb(SoupServer *server, SoupMessage *msg, const char *path,
+		    GHashTable *query, SoupClientContext *client, gpointer _unused)
+{
+	static const gchar reply[] = "mock-ws-key:25:60:websocket,xhr-polling";
+
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, "text/plain", SOUP_MEMORY_STATIC,
+				  reply, strlen(reply));
+}
+
+static void send_push(const gchar *channel, const gchar *klass, GString *record)
+{
+	gchar *frame = g_strdup_printf("3:%" G_GUINT64_FORMAT "::{\"channel\":\"%s\","
+				       "\"data\":{\"klass\":\"%s\",\"record\":%s}}",
+				       ++push_seq, channel, klass, record->str);
+
+	soup_websocket_connection_send_text(ws_conn, frame);
+	g_free(frame);
+	pushes_sent++;
+}
+
+/* Rotate between conversation messages, room messages and (if the client
+ * has subscribed to any contacts) presence changes. */
+static void push_one(void)
+{
+	GString *rec = g_string_new(NULL);
+	guint n = push_seq;
+	guint kind = n % 3;
+	gchar *id;
+
+	if (kind == 2 && !presence_subs->len)
+		kind = 0;
+	if (kind == 0 && !opt_convs)
+		kind = 1;
+	else if (kind == 1 && !opt_rooms)
+		kind = 0;
+
+	if (kind == 2) {
+		const gchar *chan = g_ptr_array_index(presence_subs, n % presence_subs->len);
+
+		g_string_append_printf(rec, "{\"ProfileId\":\"%s\",\"Revision\":%u,"
+				       "\"Availability\":%u}",
+				       strchr(chan, '!') + 1, n + 2, 1 + (n / 3) % 4);
+		send_push(chan, "Presence", rec);
+	} else if (kind == 1) {
+		id = mock_id(KIND_ROOM, n % opt_rooms);
+		append_message(rec, "RoomId", id, opt_history + n, now_str);
+		send_push(device_channel, "RoomMessage", rec);
+		g_free(id);
+	} else {
+		id = mock_id(KIND_CONV, n % opt_convs);
+		append_message(rec, "ConversationId", id, opt_history + n, now_str);
+		send_push(device_channel, "ConversationMessage", rec);
+		g_free(id);
+	}
+
+	g_string_free(rec, TRUE);
+}
+
+static gboolean push_tick(gpointer _unused)
+{
+	guint64 due = (g_get_monotonic_time() - push_start) * opt_rate / G_USEC_PER_SEC;
+
+	while (pushes_sent < due)
+		push_one();
+
+	return G_SOURCE_CONTINUE;
+}
+
+/* Presence pushes go to the contacts the client is watching */
+static void add_subscription(const gchar *chan)
+{
+	gchar *c;
+
+	if (!chan || g_hash_table_contains(subscribed, chan))
+		return;
+
+	c = g_strdup(chan);
+	g_hash_table_add(subscribed, c);
+	if (g_str_has_prefix(c, "profile_presence!") && strcmp(c, self_presence))
+		g_ptr_array_add(presence_subs, c);
+}
+
+static const gchar *get_string(JsonObject *obj, const gchar *member)
+{
+	JsonNode *node = json_object_get_member(obj, member);
+
+	if (!node || json_node_get_value_type(node) != G_TYPE_STRING)
+		return NULL;
+	return json_node_get_string(node);
+}
+
+static void handle_subscription(const gchar *json)
+{
+	JsonParser *parser = json_parser_new();
+	JsonObject *obj;
+	JsonNode *node;
+	const gchar *type, *chan;
+	guint i;
+
+	if (!json_parser_load_from_data(parser, json, -1, NULL) ||
+	    !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser)))
+		goto out;
+
+	obj = json_node_get_object(json_parser_get_root(parser));
+	type = get_string(obj, "type");
+	chan = get_string(obj, "channel");
+	if (!type)
+		goto out;
+
+	if (!strcmp(type, "subscribe")) {
+		add_subscription(chan);
+	} else if (!strcmp(type, "unsubscribe") && chan) {
+		g_ptr_array_remove_fast(presence_subs, g_hash_table_lookup(subscribed, chan));
+		g_hash_table_remove(subscribed, chan);
+	} else if (!strcmp(type, "resubscribe")) {
+		node = json_object_get_member(obj, "channels");
+		if (!node || !JSON_NODE_HOLDS_ARRAY(node))
+			goto out;
+
+		JsonArray *arr = json_node_get_array(node);
+		for (i = 0; i < json_array_get_length(arr); i++)
+			add_subscription(json_node_get_string(json_array_get_element(arr, i)));
+	}
+ out:
+	g_object_unref(parser);
+}
+
+/* We don't send heartbeats, so anything other than acks and subscription
+ * requests can be ignored. */
+static void ws_message_cb(SoupWebsocketConnection *ws, gint type, GBytes *message,
+			  gpointer _unused)
+{
+	const gchar *data = g_bytes_get_data(message, NULL);
+
+	if (type != SOUP_WEBSOCKET_DATA_TEXT)
+		return;
+
+	if (opt_verbose)
+		printf("WS recv: %s\n", data);
+
+	if (g_str_has_prefix(data, "6:::"))
+		acks_seen++;
+	else if (g_str_has_prefix(data, "3:::"))
+		handle_subscription(data + 4);
+}
+
+static void ws_closed_cb(SoupWebsocketConnection *ws, gpointer _unused)
+{
+	printf("Client disconnected; sent %" G_GUINT64_FORMAT " pushes, %" G_GUINT64_FORMAT " acked\n",
+	       pushes_sent, acks_seen);
+
+	if (push_timer) {
+		g_source_remove(push_timer);
+		push_timer = 0;
+	}
+	g_hash_table_remove_all(subscribed);
+	g_ptr_array_set_size(presence_subs, 0);
+	g_clear_object(&ws_conn);
+}
+
+static void ws_cb(SoupServer *server, SoupWebsocketConnection *ws, const char *path,
+		  SoupClientContext *client, gpointer _unused)
+{
+	if (ws_conn) {
+		soup_websocket_connection_close(ws, SOUP_WEBSOCKET_CLOSE_TRY_AGAIN_LATER, "Busy");
+		return;
+	}
+
+	printf("Client connected\n");
+
+	ws_conn = g_object_ref(ws);
+	g_signal_connect(ws, "message", G_CALLBACK(ws_message_cb), NULL);
+	g_signal_connect(ws, "closed", G_CALLBACK(ws_closed_cb), NULL);
+
+	soup_websocket_connection_send_text(ws, "1::");
+
+	pushes_sent = acks_seen = 0;
+	push_start = g_get_monotonic_time();
+	if (opt_rate > 0)
+		push_timer = g_timeout_add(PUSH_TICK_MS, push_tick, NULL);
+}
+
+static void request_read_cb(SoupServer *server, SoupMessage *msg,
+			    SoupClientContext *client, gpointer _unused)
+{
+	SoupURI *uri = soup_message_get_uri(msg);
+
+	printf("%s %s%s%s\n", msg->method, soup_uri_get_path(uri),
+	       soup_uri_get_query(uri) ? "?" : "",
+	       soup_uri_get_query(uri) ? soup_uri_get_query(uri) : "");
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *ctx;
+	GError *error = NULL;
+	SoupServer *server;
+	GTimeVal tv;
+
+	ctx = g_option_context_new("- mock Chime service");
+	g_option_context_add_main_entries(ctx, options, NULL);
+	if (!g_option_context_parse(ctx, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(ctx);
+
+	/* Nothing to push about */
+	if (!opt_rooms && !opt_convs)
+		opt_rate = 0;
+
+	g_get_current_time(&tv);
+	now_str = g_time_val_to_iso8601(&tv);
+	self_id = mock_id(KIND_SELF, 0);
+	self_presence = g_strdup_printf("profile_presence!%s", self_id);
+	device_channel = g_strdup_printf("device!%s", self_id);
+
+	subscribed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	presence_subs = g_ptr_array_new();
+
+	server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "chime-mock", NULL);
+	if (!soup_server_listen_local(server, opt_port, SOUP_SERVER_LISTEN_IPV4_ONLY, &error)) {
+		fprintf(stderr, "Failed to listen on port %d: %s\n", opt_port, error->message);
+		return EXIT_FAILURE;
+	}
+
+	GSList *uris = soup_server_get_uris(server);
+	base_url = soup_uri_to_string(uris->data, FALSE);
+	g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+
+	soup_server_add_handler(server, "/sessions", sessions_cb, NULL, NULL);
+	soup_server_add_handler(server, "/profile", profile_cb, NULL, NULL);
+	soup_server_add_handler(server, "/contacts", contacts_cb, NULL, NULL);
+	soup_server_add_handler(server, "/messaging", messaging_cb, NULL, NULL);
+	soup_server_add_handler(server, "/presence", presence_cb, NULL, NULL);
+	soup_server_add_handler(server, "/conference", conference_cb, NULL, NULL);
+	soup_server_add_handler(server, "/push", push_cb, NULL, NULL);
+	soup_server_add_websocket_handler(server, "/push/1/websocket", NULL, NULL,
+					  ws_cb, NULL, NULL);
+	if (opt_verbose)
+		g_signal_connect(server, "request-read", G_CALLBACK(request_read_cb), NULL);
+
+	printf("Mock Chime service at %s\n"
+	       "%d contacts, %d rooms, %d conversations, %d pushes/s\n",
+	       base_url, opt_contacts, opt_rooms, opt_convs, opt_rate);
+	fflush(stdout);
+
+	g_main_loop_run(g_main_loop_new(NULL, FALSE));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,398 @@
+/*
+ * Replays a Juggernaut capture (see CHIME_JUGG_CAPTURE in README.md)
+ * through libchime's normal frame handling, against a connection to
+ * chime-mock which provides the contacts, rooms and conversations. Reports
+ * the dispatch rate, and the handler time and allocations for each klass.
+ *
+ * The capturing connection's own profile, presence and device channels are
+ * rewritten to the replaying connection's, so pushes to them reach the
+ * same handlers they did originally. Pushes about objects the mock doesn't
+ * know will make libchime go and look them up, just as they would have in
+ * real life.
+ *
+ * Run the mock with --rate 0, or its own pushes will be counted along with
+ * the replayed ones.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chime/chime-connection-private.h"
+
+static gchar *opt_server = "http://127.0.0.1:8080/";
+static gboolean opt_realtime;
+static gint opt_loops = 1;
+
+static GOptionEntry options[] = {
+	{ "server", 's', 0, G_OPTION_ARG_STRING, &opt_server, "Mock service URL (default http://127.0.0.1:8080/)", "URL" },
+	{ "realtime", 'r', 0, G_OPTION_ARG_NONE, &opt_realtime, "Replay at the recorded pace instead of flat out", NULL },
+	{ "loops", 'l', 0, G_OPTION_ARG_INT, &opt_loops, "Times to replay the capture (default 1)", "N" },
+	{ NULL }
+};
+
+#ifdef __GLIBC__
+/* Count allocations by interposing on glibc's allocator. Everything in the
+ * process comes through here, including GLib's g_malloc(). */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static guint64 nr_allocs;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+#define alloc_count() __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED)
+#else
+#define alloc_count() ((guint64)0)
+#endif
+
+#define CAPTURE_MAGIC "CHJUGG01"
+
+struct frame {
+	gint64 ts;
+	const gchar *data;	/* Points into the capture until rewritten */
+	guint32 len;
+	const gchar *klass;	/* Interned */
+};
+
+struct klass_stats {
+	const gchar *klass;
+	guint64 count;
+	gint64 usec;
+	guint64 allocs;
+};
+
+static GMainLoop *loop;
+static int status;
+
+static gchar *capture;
+static gsize capture_len;
+static gchar *cap_channels[3];
+static GArray *frames;
+static GStringChunk *rewritten;
+
+static guint next_frame;
+static gint loops_done;
+static gint64 replay_start, ts_base;
+static GHashTable *stats;
+static guint64 total_frames;
+static gint64 total_usec;
+
+static gboolean read_bytes(const gchar **p, gsize want, const void **out)
+{
+	if ((gsize)(capture + capture_len - *p) < want)
+		return FALSE;
+	*out = *p;
+	*p += want;
+	return TRUE;
+}
+
+static gboolean load_capture(const gchar *path, GError **error)
+{
+	const gchar *p;
+	const void *v;
+	int i;
+
+	if (!g_file_get_contents(path, &capture, &capture_len, error))
+		return FALSE;
+
+	p = capture;
+	if (!read_bytes(&p, strlen(CAPTURE_MAGIC), &v) ||
+	    memcmp(v, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)))
+		goto bad;
+
+	for (i = 0; i < 3; i++) {
+		guint16 len;
+
+		if (!read_bytes(&p, sizeof(len), &v))
+			goto bad;
+		memcpy(&len, v, sizeof(len));
+		len = GUINT16_FROM_LE(len);
+		if (!read_bytes(&p, len, &v))
+			goto bad;
+		cap_channels[i] = g_strndup(v, len);
+	}
+
+	frames = g_array_new(FALSE, FALSE, sizeof(struct frame));
+	while (p < capture + capture_len) {
+		struct frame f;
+
+		if (!read_bytes(&p, sizeof(f.ts), &v))
+			goto bad;
+		memcpy(&f.ts, v, sizeof(f.ts));
+		f.ts = GINT64_FROM_LE(f.ts);
+		if (!read_bytes(&p, sizeof(f.len), &v))
+			goto bad;
+		memcpy(&f.len, v, sizeof(f.len));
+		f.len = GUINT32_FROM_LE(f.len);
+		if (!read_bytes(&p, f.len, &v))
+			goto bad;
+		f.data = v;
+		f.klass = NULL;
+		g_array_append_val(frames, f);
+	}
+	return TRUE;
+
+ bad:
+	g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		    "%s: not a Juggernaut capture, or truncated", path);
+	return FALSE;
+}
+
+static void replace_all(GString *str, const gchar *from, const gchar *to)
+{
+	gsize from_len = strlen(from), to_len = strlen(to);
+	gsize pos = 0;
+	gchar *hit;
+
+	if (!from_len || !strcmp(from, to))
+		return;
+
+	while ((hit = strstr(str->str + pos, from))) {
+		pos = hit - str->str;
+		g_string_erase(str, pos, from_len);
+		g_string_insert(str, pos, to);
+		pos += to_len;
+	}
+}
+
+/* A rough klass for reporting, without parsing the JSON */
+static const gchar *frame_klass(const gchar *data)
+{
+	const gchar *k = strstr(data, "\"klass\":\"");
+	const gchar *end;
+	gchar *tmp;
+	const gchar *ret;
+
+	if (!g_str_has_prefix(data, "3:"))
+		return g_intern_static_string("(control)");
+	if (!k)
+		return g_intern_static_string("(none)");
+
+	k += 9;
+	end = strchr(k, '"');
+	if (!end)
+		return g_intern_static_string("(none)");
+
+	tmp = g_strndup(k, end - k);
+	ret = g_intern_string(tmp);
+	g_free(tmp);
+	return ret;
+}
+
+/* Rewrite the capturing connection's channels to ours, once up front so it
+ * doesn't count towards the replay time. */
+static void prepare_frames(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	const gchar *ours[3] = { priv->profile_channel, priv->presence_channel,
+				 priv->device_channel };
+	GString *buf = g_string_new(NULL);
+	guint i;
+	int c;
+
+	rewritten = g_string_chunk_new(capture_len + 1);
+	for (i = 0; i < frames->len; i++) {
+		struct frame *f = &g_array_index(frames, struct frame, i);
+
+		g_string_truncate(buf, 0);
+		g_string_append_len(buf, f->data, f->len);
+		for (c = 0; c < 3; c++) {
+			if (ours[c])
+				replace_all(buf, cap_channels[c], ours[c]);
+		}
+		f->data = g_string_chunk_insert_len(rewritten, buf->str, buf->len);
+		f->len = buf->len;
+		f->klass = frame_klass(f->data);
+	}
+	g_string_free(buf, TRUE);
+}
+
+static void replay_one(ChimeConnection *cxn, struct frame *f)
+{
+	struct klass_stats *st;
+	gint64 start;
+	guint64 allocs;
+
+	/* That would make libchime give up on the connection */
+	if (f->len == 3 && !memcmp(f->data, "0::", 3))
+		return;
+
+	allocs = alloc_count();
+	start = g_get_monotonic_time();
+	chime_jugg_replay_frame(cxn, f->data, f->len);
+	start = g_get_monotonic_time() - start;
+	allocs = alloc_count() - allocs;
+
+	st = g_hash_table_lookup(stats, f->klass);
+	if (!st) {
+		st = g_new0(struct klass_stats, 1);
+		st->klass = f->klass;
+		g_hash_table_insert(stats, (gpointer)f->klass, st);
+	}
+	st->count++;
+	st->usec += start;
+	st->allocs += allocs;
+
+	total_frames++;
+	total_usec += start;
+}
+
+static gint compare_time(gconstpointer _a, gconstpointer _b)
+{
+	const struct klass_stats *a = _a;
+	const struct klass_stats *b = _b;
+
+	return (b->usec > a->usec) - (b->usec < a->usec);
+}
+
+static void report(void)
+{
+	gint64 elapsed = g_get_monotonic_time() - replay_start;
+	GList *sorted = g_list_sort(g_hash_table_get_values(stats), compare_time);
+	GList *l;
+
+	printf("Replayed %" G_GUINT64_FORMAT " frames in %.2fs: %.1f/s wall, %.1f/s in dispatch\n",
+	       total_frames, elapsed / 1000000.0, total_frames * 1000000.0 / elapsed,
+	       total_usec ? total_frames * 1000000.0 / total_usec : 0.0);
+
+	printf("%-32s %10s %10s %10s %10s\n", "klass", "count", "total ms", "us/msg", "allocs/msg");
+	for (l = sorted; l; l = l->next) {
+		struct klass_stats *st = l->data;
+
+		printf("%-32s %10" G_GUINT64_FORMAT " %10.1f %10.1f %10.1f\n",
+		       st->klass, st->count, st->usec / 1000.0,
+		       (double)st->usec / st->count, (double)st->allocs / st->count);
+	}
+	g_list_free(sorted);
+}
+
+static gboolean replay_cb(gpointer _cxn)
+{
+	ChimeConnection *cxn = _cxn;
+	gint64 now;
+	guint batch = 0;
+
+	while (loops_done < opt_loops) {
+		struct frame *f;
+
+		if (next_frame == frames->len) {
+			next_frame = 0;
+			loops_done++;
+			ts_base = 0;
+			continue;
+		}
+
+		f = &g_array_index(frames, struct frame, next_frame);
+		if (opt_realtime) {
+			now = g_get_monotonic_time();
+			if (!ts_base)
+				ts_base = now - f->ts;
+			if (f->ts + ts_base > now) {
+				g_timeout_add(MAX(1, (f->ts + ts_base - now) / 1000), replay_cb, cxn);
+				return G_SOURCE_REMOVE;
+			}
+		} else if (++batch > 256) {
+			/* Let the main loop run, to send acks and so on */
+			return G_SOURCE_CONTINUE;
+		}
+
+		replay_one(cxn, f);
+		next_frame++;
+	}
+
+	report();
+	chime_connection_disconnect(cxn);
+	return G_SOURCE_REMOVE;
+}
+
+static void connected(ChimeConnection *cxn, const gchar *display_name, gpointer _unused)
+{
+	prepare_frames(cxn);
+	printf("Online as %s; replaying %u frames %s\n", display_name, frames->len,
+	       opt_realtime ? "at the recorded pace" : "flat out");
+	fflush(stdout);
+
+	replay_start = g_get_monotonic_time();
+	if (opt_realtime)
+		replay_cb(cxn);
+	else
+		g_idle_add(replay_cb, cxn);
+}
+
+static void disconnected(ChimeConnection *cxn, GError *error, gpointer _unused)
+{
+	if (error) {
+		fprintf(stderr, "ERROR: %s\n", error->message);
+		status = EXIT_FAILURE;
+	}
+	if (g_main_loop_is_running(loop))
+		g_main_loop_quit(loop);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *ctx;
+	GError *error = NULL;
+	ChimeConnection *cxn;
+
+	ctx = g_option_context_new("CAPTURE - replay Juggernaut traffic through libchime");
+	g_option_context_add_main_entries(ctx, options, NULL);
+	if (!g_option_context_parse(ctx, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(ctx);
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s [OPTION...] CAPTURE\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!load_capture(argv[1], &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	/* Don't capture the replay over the top of what we're replaying */
+	g_unsetenv("CHIME_JUGG_CAPTURE");
+
+	loop = g_main_loop_new(NULL, FALSE);
+	stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	status = EXIT_SUCCESS;
+
+	cxn = chime_connection_new("replay@example.com", opt_server, "replay-device",
+				   "replay-session-token");
+
+	g_signal_connect(cxn, "connected", G_CALLBACK(connected), NULL);
+	g_signal_connect(cxn, "disconnected", G_CALLBACK(disconnected), NULL);
+
+	chime_connection_connect(cxn);
+	g_main_loop_run(loop);
+
+	g_object_unref(cxn);
+	g_main_loop_unref(loop);
+	g_hash_table_destroy(stats);
+	if (rewritten)
+		g_string_chunk_free(rewritten);
+	g_array_free(frames, TRUE);
+	g_free(capture);
+	return status;
+}
@@ -67,7 +67,7 @@ static gboolean audio_receive_rt_msg(ChimeCallAudio *audio, gconstpointer pkt, g
 			GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
 			if (gst_rtp_buffer_map(buffer, GST_MAP_WRITE, &rtp)) {
 
-				chime_debug("Audio RX seq %d ts %u\n", msg->audio->seq, msg->audio->sample_time);
+				CHIME_TRACE("Audio RX seq %d ts %u\n", msg->audio->seq, msg->audio->sample_time);
 
 				gst_rtp_buffer_set_ssrc(&rtp, audio->recv_ssrc);
 				gst_rtp_buffer_set_payload_type(&rtp, 97);
@@ -81,7 +81,7 @@ static gboolean audio_receive_rt_msg(ChimeCallAudio *audio, gconstpointer pkt, g
 				gst_app_src_push_buffer(GST_APP_SRC(audio->audio_src), buffer);
 			}
 		} else if (msg->audio->has_audio && msg->audio->audio.len) {
-			chime_debug("Audio drop (%p %d) seq %d ts %u\n",
+			CHIME_TRACE("Audio drop (%p %d) seq %d ts %u\n",
 				    audio->audio_src, audio->appsrc_need_data,
 				    msg->audio->seq, msg->audio->sample_time);
 		}
@@ -178,7 +178,7 @@ static void do_send_rt_packet(ChimeCallAudio *audio, GstBuffer *buffer)
 		dur = GST_BUFFER_DURATION(buffer);
 
 		nr_samples = GST_BUFFER_DURATION(buffer) / NS_PER_SAMPLE;
-		chime_debug("buf dts %ld pts %ld dur %ld samples %d\n", dts, pts, dur, nr_samples);
+		CHIME_TRACE("buf dts %ld pts %ld dur %ld samples %d\n", dts, pts, dur, nr_samples);
 
 		if (audio->next_dts && dts > audio->next_dts) {
 			/* We skipped some. */
@@ -63,6 +63,16 @@ enum screen_pkt_flag {
 	SCREEN_PKT_FLAG_UNICAST = 8,
 };
 
+/* Set CHIME_SCREEN_DEBUG to dump every frame; looked up only once. */
+static gboolean screen_debug(void)
+{
+	static gsize on;
+
+	if (g_once_init_enter(&on))
+		g_once_init_leave(&on, getenv("CHIME_SCREEN_DEBUG") ? 2 : 1);
+	return on == 2;
+}
+
 static void hexdump(const void *buf, int len)
 {
 	char linechars[17];
@@ -88,33 +98,36 @@ static void hexdump(const void *buf, int len)
 
 static void screen_send_packet(ChimeCallScreen *screen, enum screen_pkt_type type, void *data, size_t dlen)
 {
-	unsigned char source = 0;
-	unsigned char dest = 0;
-	enum screen_pkt_flag flag = SCREEN_PKT_FLAG_LOCAL;
+	struct screen_pkt pkt;
+	GOutputVector vecs[2] = {
+		{ &pkt, sizeof(pkt) },
+		{ data, dlen },
+	};
 
-	g_mutex_lock(&screen->transport_lock);
-	if (dlen) {
-		/* Ick, we need to fix websockets to take iovecs */
-		struct screen_pkt *buf = g_malloc0(sizeof(*buf) + dlen);
-		buf->type = type;
-		buf->source = source;
-		buf->dest = dest;
-		buf->flag = flag;
-		memcpy(&buf[1], data, dlen);
-
-		soup_websocket_connection_send_binary(screen->ws, buf, sizeof(*buf) + dlen);
-	} else {
-		struct screen_pkt pkt;
-		pkt.type = type;
-		pkt.source = source;
-		pkt.dest = dest;
-		pkt.flag = flag;
+	pkt.type = type;
+	pkt.source = 0;
+	pkt.dest = 0;
+	pkt.flag = SCREEN_PKT_FLAG_LOCAL;
 
-		soup_websocket_connection_send_binary(screen->ws, &pkt, sizeof(pkt));
-	}
+	g_mutex_lock(&screen->transport_lock);
+	soup_websocket_connection_send_binary_iov(screen->ws, vecs, dlen ? 2 : 1);
 	g_mutex_unlock(&screen->transport_lock);
 }
 
+static void screen_request_keyframe(ChimeCallScreen *screen)
+{
+	GstEvent *ev = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, FALSE, 0);
+	GstPad *pad = gst_element_get_static_pad(GST_ELEMENT(screen->screen_sink), "sink");
+	GstPad *peer = gst_pad_get_peer(pad);
+
+	if (peer) {
+		gst_pad_send_event(peer, ev);
+		gst_object_unref(peer);
+	} else
+		gst_event_unref(ev);
+	gst_object_unref(pad);
+}
+
 static void on_screenws_closed(SoupWebsocketConnection *ws, gpointer _screen)
 {
 	//	ChimeCallScreen *screen = _screen;
@@ -130,7 +143,7 @@ static void on_screenws_message(SoupWebsocketConnection *ws, gint type,
 	gsize s;
 	gconstpointer d = g_bytes_get_data(message, &s);
 
-	if (getenv("CHIME_SCREEN_DEBUG")) {
+	if (screen_debug()) {
 		printf("incoming:\n");
 		hexdump(d, s);
 	}
@@ -145,12 +158,8 @@ static void on_screenws_message(SoupWebsocketConnection *ws, gint type,
 		break;
 
 	case SCREEN_PKT_TYPE_KEY_REQUEST:
-		if (screen->screen_sink) {
-			GstEvent *ev = gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, FALSE, 0);
-			GstPad *pad = gst_element_get_static_pad(GST_ELEMENT(screen->screen_sink), "sink");
-			GstPad *peer = gst_pad_get_peer(pad);
-			gst_pad_send_event(peer, ev);
-		}
+		if (screen->screen_sink)
+			screen_request_keyframe(screen);
 		break;
 
 	case SCREEN_PKT_TYPE_STREAM_STOP:
@@ -173,6 +182,29 @@ static void on_screenws_message(SoupWebsocketConnection *ws, gint type,
 	}
 }
 
+#ifndef USE_LIBSOUP_WEBSOCKETS
+/* When frames are being captured faster than they can be sent, stop
+ * sending delta frames until the backlog has drained rather than let it
+ * grow without limit; then start again from a fresh key frame. */
+static void on_screenws_stalled(SoupWebsocketConnection *ws, gpointer _screen)
+{
+	ChimeCallScreen *screen = _screen;
+
+	chime_debug("screen ws stalled with %" G_GSIZE_FORMAT " bytes queued\n",
+		    chime_websocket_connection_get_buffered_amount(ws));
+	g_atomic_int_set(&screen->ws_stalled, TRUE);
+}
+
+static void on_screenws_writable(SoupWebsocketConnection *ws, gpointer _screen)
+{
+	ChimeCallScreen *screen = _screen;
+
+	chime_debug("screen ws writable\n");
+	g_atomic_int_set(&screen->ws_stalled, FALSE);
+	if (g_atomic_int_get(&screen->need_keyframe) && screen->screen_sink)
+		screen_request_keyframe(screen);
+}
+#endif
 
 static void screen_ws_connect_cb(GObject *obj, GAsyncResult *res, gpointer _screen)
 {
@@ -193,6 +225,10 @@ static void screen_ws_connect_cb(GObject *obj, GAsyncResult *res, gpointer _scre
 	chime_debug("screen ws connected!\n");
 	g_signal_connect(G_OBJECT(ws), "closed", G_CALLBACK(on_screenws_closed), screen);
 	g_signal_connect(G_OBJECT(ws), "message", G_CALLBACK(on_screenws_message), screen);
+#ifndef USE_LIBSOUP_WEBSOCKETS
+	g_signal_connect(G_OBJECT(ws), "stalled", G_CALLBACK(on_screenws_stalled), screen);
+	g_signal_connect(G_OBJECT(ws), "writable", G_CALLBACK(on_screenws_writable), screen);
+#endif
 
 	g_object_set(G_OBJECT(ws), "max-incoming-payload-size", 0, NULL);
 
@@ -334,21 +370,42 @@ static GstFlowReturn screen_appsink_new_sample(GstAppSink* self, gpointer data)
 
 	if (screen->state == CHIME_SCREEN_STATE_SENDING) {
 		GstBuffer *buffer = gst_sample_get_buffer(sample);
-		gsize len = gst_buffer_get_size(buffer);
-
-		/* Ick, we need to fix websockets to take iovecs */
-		struct screen_pkt *buf = g_malloc0(sizeof(*buf) + len);
-		buf->type = SCREEN_PKT_TYPE_CAPTURE;
-		buf->source = 0;
-		buf->dest = 0;
-		buf->flag = SCREEN_PKT_FLAG_BROADCAST;
-		gst_buffer_extract(buffer, 0, &buf[1], len);
-		g_mutex_lock(&screen->transport_lock);
-		if (screen->ws && screen->state == CHIME_SCREEN_STATE_SENDING)
-			soup_websocket_connection_send_binary(screen->ws, buf, sizeof(*buf) + len);
-		g_mutex_unlock(&screen->transport_lock);
-		g_free(buf);
+		struct screen_pkt pkt;
+		GstMapInfo map;
+
+		/* A delta frame is no use to viewers who missed what it is
+		 * relative to, so once one has been dropped, drop the rest
+		 * until the next key frame. */
+		if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+			if (g_atomic_int_get(&screen->ws_stalled) ||
+			    g_atomic_int_get(&screen->need_keyframe)) {
+				g_atomic_int_set(&screen->need_keyframe, TRUE);
+				goto out;
+			}
+		} else
+			g_atomic_int_set(&screen->need_keyframe, FALSE);
+
+		pkt.type = SCREEN_PKT_TYPE_CAPTURE;
+		pkt.source = 0;
+		pkt.dest = 0;
+		pkt.flag = SCREEN_PKT_FLAG_BROADCAST;
+
+		/* The frame goes straight from GStreamer's buffer into the
+		 * WebSocket frame, without being put together here first */
+		if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+			GOutputVector vecs[2] = {
+				{ &pkt, sizeof(pkt) },
+				{ map.data, map.size },
+			};
+
+			g_mutex_lock(&screen->transport_lock);
+			if (screen->ws && screen->state == CHIME_SCREEN_STATE_SENDING)
+				soup_websocket_connection_send_binary_iov(screen->ws, vecs, 2);
+			g_mutex_unlock(&screen->transport_lock);
+			gst_buffer_unmap(buffer, &map);
+		}
 	}
+ out:
 	gst_sample_unref(sample);
 
 	return GST_FLOW_OK;
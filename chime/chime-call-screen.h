@@ -36,6 +36,10 @@ struct _ChimeCallScreen {
 	GstAppSink *screen_sink;
 
 	SoupWebsocketConnection *ws;
+
+	/* Shared with the GStreamer streaming thread, so use g_atomic_int_*() */
+	gint ws_stalled;
+	gint need_keyframe;
 };
 
 /* Called from ChimeMeeting */
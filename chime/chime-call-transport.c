@@ -27,6 +27,17 @@
 
 #define CHIME_DTLS_MTU 1196
 
+/* Set CHIME_AUDIO_DEBUG to dump every packet. It's checked per packet, so
+ * only look it up once. */
+static gboolean audio_debug(void)
+{
+	static gsize on;
+
+	if (g_once_init_enter(&on))
+		g_once_init_leave(&on, getenv("CHIME_AUDIO_DEBUG") ? 2 : 1);
+	return on == 2;
+}
+
 static void hexdump(const void *buf, int len)
 {
 	char linechars[17];
@@ -64,7 +75,7 @@ static void on_audiows_message(SoupWebsocketConnection *ws, gint type,
 	gsize s;
 	gconstpointer d = g_bytes_get_data(message, &s);
 
-	if (getenv("CHIME_AUDIO_DEBUG")) {
+	if (audio_debug()) {
 		printf("incoming:\n");
 		hexdump(d, s);
 	}
@@ -99,7 +110,7 @@ static void audio_send_auth_packet(ChimeCallAudio *audio)
 
 	msg.profile_uuid = (char *)chime_connection_get_profile_id(cxn);
 
-	/* XX: What if it *just* expired? We'll need to renew it and try again? */
+	/* The connection renews this ahead of expiry, so it should be good */
 	msg.session_token = priv->session_token;
 
 	msg.codec = 7; /* Opus Med. Later... */
@@ -137,7 +148,7 @@ static void audio_send_hangup_packet(ChimeCallAudio *audio)
 
 	msg.profile_uuid = (char *)chime_connection_get_profile_id(cxn);
 
-	/* XX: What if it *just* expired? We'll need to renew it and try again? */
+	/* The connection renews this ahead of expiry, so it should be good */
 	msg.session_token = priv->session_token;
 
 	msg.codec = 7; /* Opus Med. Later... */
@@ -420,7 +431,7 @@ static gboolean dtls_src_cb(GDatagramBased *dgram, GIOCondition condition, Chime
 	unsigned char pkt[CHIME_DTLS_MTU];
 	ssize_t len = gnutls_record_recv(audio->dtls_sess, pkt, sizeof(pkt));
 	if (len > 0) {
-		if (getenv("CHIME_AUDIO_DEBUG")) {
+		if (audio_debug()) {
 			printf("incoming:\n");
 			hexdump(pkt, len);
 		}
@@ -442,12 +453,27 @@ static gboolean dtls_timeout(ChimeCallAudio *audio)
 static int dtls_verify_cb(gnutls_session_t sess)
 {
 	ChimeCallAudio *audio = gnutls_session_get_ptr(sess);
-	unsigned int status;
+	const gnutls_datum_t *peer;
+	unsigned int i, status, nr_peer = 0;
+	GPtrArray *chain;
 	int ret;
 
+	/* Shared with req_started_cb(), so we may already have seen it */
+	peer = gnutls_certificate_get_peers(sess, &nr_peer);
+	chain = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+	for (i = 0; peer && i < nr_peer; i++)
+		g_ptr_array_add(chain, g_bytes_new_static(peer[i].data, peer[i].size));
+
+	if (chime_cert_cache_lookup(chain, audio->dtls_hostname)) {
+		g_ptr_array_unref(chain);
+		return 0;
+	}
+
 	ret = gnutls_certificate_verify_peers3(sess, audio->dtls_hostname, &status);
-	if (ret != GNUTLS_E_SUCCESS)
+	if (ret != GNUTLS_E_SUCCESS) {
+		g_ptr_array_unref(chain);
 		return ret;
+	}
 
 	if (status) {
 		gnutls_datum_t reasons;
@@ -455,8 +481,12 @@ static int dtls_verify_cb(gnutls_session_t sess)
 			reasons.data = NULL;
 		chime_debug("DTLS certificate verification failed (%u): %s\n", status, reasons.data);
 		gnutls_free(reasons.data);
+		g_ptr_array_unref(chain);
 		return -1;
 	}
+
+	chime_cert_cache_add(chain, audio->dtls_hostname);
+	g_ptr_array_unref(chain);
 	return 0;
 }
 
@@ -674,13 +704,16 @@ void chime_call_transport_send_packet(ChimeCallAudio *audio, enum xrp_pkt_type t
 		return;
 
 	size_t len = protobuf_c_message_get_packed_size(message);
+	guint64 stackbuf[1024 / sizeof(guint64)];
 
+	/* Audio packets are small, so pack them on the stack. Both the DTLS
+	 * and WebSocket sends copy them anyway. */
 	len += sizeof(struct xrp_header);
-	struct xrp_header *hdr = g_malloc0(len);
+	struct xrp_header *hdr = len <= sizeof(stackbuf) ? (void *)stackbuf : g_malloc(len);
 	hdr->type = htons(type);
 	hdr->len = htons(len);
 	protobuf_c_message_pack(message, (void *)(hdr + 1));
-	if (getenv("CHIME_AUDIO_DEBUG")) {
+	if (audio_debug()) {
 		printf("sending protobuf of len %zd\n", len);
 		hexdump(hdr, len);
 	}
@@ -690,5 +723,6 @@ void chime_call_transport_send_packet(ChimeCallAudio *audio, enum xrp_pkt_type t
 	else if (audio->ws)
 		soup_websocket_connection_send_binary(audio->ws, hdr, len);
 	g_mutex_unlock(&audio->transport_lock);
-	g_free(hdr);
+	if (hdr != (void *)stackbuf)
+		g_free(hdr);
 }
@@ -20,6 +20,8 @@
 
 #include <gio/gio.h>
 
+#include <gnutls/x509.h>
+
 #define NR_CERTS 7
 
 static const char *cert_filenames[NR_CERTS] = {
@@ -57,3 +59,135 @@ GSList *chime_cert_list(void)
 	}
 	return ret;
 }
+
+/*
+ * Certificate chains which we have already verified for a given host, so
+ * that we don't have to walk them against each of the Amazon CAs on every
+ * request (or every DTLS handshake). Keyed by the SHA256 of the whole DER
+ * chain as presented, and the hostname; the value is the earliest expiry
+ * time in the chain, after which the entry is ignored. The lookups come
+ * from libsoup and from the call's DTLS handshake, which needn't be on the
+ * same thread, so it's all under cert_cache_lock.
+ */
+#define CERT_CACHE_MAX 64
+
+static GMutex cert_cache_lock;
+static GHashTable *cert_cache;
+
+/* Returns an array of GBytes, the peer's own certificate first */
+GPtrArray *chime_cert_chain_from_tls(GTlsCertificate *cert)
+{
+	GPtrArray *chain = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+
+	while (cert) {
+		GByteArray *der;
+
+		g_object_get(cert, "certificate", &der, NULL);
+		if (!der)
+			break;
+		g_ptr_array_add(chain, g_byte_array_free_to_bytes(der));
+		cert = g_tls_certificate_get_issuer(cert);
+	}
+	return chain;
+}
+
+static gchar *cert_cache_key(GPtrArray *chain, const gchar *host)
+{
+	GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+	gchar *key;
+	guint i;
+
+	/* Length-prefixed, so the boundaries count too */
+	for (i = 0; i < chain->len; i++) {
+		gsize len;
+		const guint8 *der = g_bytes_get_data(chain->pdata[i], &len);
+		guint32 len32 = GUINT32_TO_BE(len);
+
+		g_checksum_update(sum, (const guchar *)&len32, sizeof(len32));
+		g_checksum_update(sum, der, len);
+	}
+	key = g_strdup_printf("%s %s", g_checksum_get_string(sum), host);
+	g_checksum_free(sum);
+	return key;
+}
+
+static gboolean cert_expired(gpointer _key, gpointer _expiry, gpointer _now)
+{
+	return *(gint64 *)_expiry <= *(gint64 *)_now;
+}
+
+gboolean chime_cert_cache_lookup(GPtrArray *chain, const gchar *host)
+{
+	gchar *key;
+	gint64 *expiry;
+
+	if (!host || !chain->len)
+		return FALSE;
+
+	key = cert_cache_key(chain, host);
+
+	g_mutex_lock(&cert_cache_lock);
+	expiry = cert_cache ? g_hash_table_lookup(cert_cache, key) : NULL;
+	if (expiry && *expiry <= g_get_real_time() / G_USEC_PER_SEC) {
+		g_hash_table_remove(cert_cache, key);
+		expiry = NULL;
+	}
+	g_mutex_unlock(&cert_cache_lock);
+
+	g_free(key);
+	return !!expiry;
+}
+
+/* Only call this for a chain which has been fully verified for @host */
+void chime_cert_cache_add(GPtrArray *chain, const gchar *host)
+{
+	gint64 *expiry, now;
+	guint i;
+
+	if (!host || !chain->len)
+		return;
+
+	expiry = g_new(gint64, 1);
+	*expiry = G_MAXINT64;
+	for (i = 0; i < chain->len; i++) {
+		gnutls_x509_crt_t crt;
+		gnutls_datum_t d;
+		gsize len;
+
+		d.data = (unsigned char *)g_bytes_get_data(chain->pdata[i], &len);
+		d.size = len;
+
+		if (gnutls_x509_crt_init(&crt)) {
+			g_free(expiry);
+			return;
+		}
+		if (gnutls_x509_crt_import(crt, &d, GNUTLS_X509_FMT_DER)) {
+			gnutls_x509_crt_deinit(crt);
+			g_free(expiry);
+			return;
+		}
+		*expiry = MIN(*expiry, gnutls_x509_crt_get_expiration_time(crt));
+		gnutls_x509_crt_deinit(crt);
+	}
+
+	now = g_get_real_time() / G_USEC_PER_SEC;
+	if (*expiry <= now) {
+		g_free(expiry);
+		return;
+	}
+
+	g_mutex_lock(&cert_cache_lock);
+	if (!cert_cache)
+		cert_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	/* Nobody talks to enough hosts for this to matter, but don't let it grow
+	 * without bound. */
+	if (g_hash_table_size(cert_cache) >= CERT_CACHE_MAX) {
+		g_hash_table_foreach_remove(cert_cache, cert_expired, &now);
+		if (g_hash_table_size(cert_cache) >= CERT_CACHE_MAX)
+			g_hash_table_remove_all(cert_cache);
+	}
+
+	g_hash_table_replace(cert_cache, cert_cache_key(chain, host), expiry);
+	g_mutex_unlock(&cert_cache_lock);
+}
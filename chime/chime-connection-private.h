@@ -25,6 +25,7 @@
 #include "chime-conversation.h"
 #include "chime-meeting.h"
 #include "chime-call.h"
+#include "chime-log.h"
 
 #include <libsoup/soup.h>
 
@@ -42,8 +43,26 @@
 #define soup_websocket_connection_get_state chime_websocket_connection_get_state
 #define soup_websocket_connection_send_text chime_websocket_connection_send_text
 #define soup_websocket_connection_send_binary chime_websocket_connection_send_binary
+#define soup_websocket_connection_send_binary_iov chime_websocket_connection_send_binary_iov
 #define soup_websocket_connection_close chime_websocket_connection_close
 #define SoupWebsocketConnection ChimeWebsocketConnection
+#else
+/* We only do permessage-deflate in our own WebSocket code */
+#define chime_websocket_offer_deflate(msg) do { } while (0)
+
+/* libsoup can't send a message in pieces, so put it together for it */
+static inline void soup_websocket_connection_send_binary_iov(SoupWebsocketConnection *ws,
+							     const GOutputVector *vectors,
+							     guint n_vectors)
+{
+	GByteArray *buf = g_byte_array_new();
+	guint i;
+
+	for (i = 0; i < n_vectors; i++)
+		g_byte_array_append(buf, vectors[i].buffer, vectors[i].size);
+	soup_websocket_connection_send_binary(ws, buf->data, buf->len);
+	g_byte_array_unref(buf);
+}
 #endif
 
 #define CHIME_ENUM_VALUE(val, nick) { val, #val, nick },
@@ -87,16 +106,76 @@ typedef enum {
 #define CHIME_DEVICE_CAP_WEBINAR			(1<<3)
 #define CHIME_DEVICE_CAP_PRESENCE_SUBSCRIPTION		(1<<4)
 
+/* chime-json-stream.c */
+typedef struct _ChimeJsonStream ChimeJsonStream;
+typedef void (*ChimeJsonElementFunc)(JsonNode *node, gpointer user_data);
+
+ChimeJsonStream *chime_json_stream_new(const gchar *member,
+				       ChimeJsonElementFunc func,
+				       gpointer user_data);
+void chime_json_stream_feed(ChimeJsonStream *js, const gchar *data, gsize len);
+JsonNode *chime_json_stream_finish(ChimeJsonStream *js, GError **error);
+gint64 chime_json_stream_get_parse_time(ChimeJsonStream *js);
+void chime_json_stream_free(ChimeJsonStream *js);
+
 /* SoupMessage handling for Chime communication, with retry on re-auth
  * and JSON parsing. XX: MAke this a proper superclass of SoupMessage */
+typedef enum {
+	CHIME_HTTP_CACHE = 1 << 0,	/* Conditional GET against the on-disk cache */
+	CHIME_HTTP_IDEMPOTENT = 1 << 1,	/* Safe to retry, even if not GET/HEAD */
+} ChimeHttpFlags;
+
 struct chime_msg {
 	ChimeConnection *cxn;
 	ChimeSoupMessageCallback cb;
 	gpointer cb_data;
 	SoupMessage *msg;
 	gboolean auto_renew;
+	ChimeRequestPriority prio;
+	ChimeHttpFlags flags;
+	const gchar *host;	/* Interned */
+
+	/* For streamed responses */
+	const gchar *stream_member;
+	ChimeSoupElementCallback elem_cb;
+	ChimeJsonStream *stream;
+	gboolean streamed;	/* Some elements have gone to elem_cb */
+
+	/* For cached responses */
+	gchar *cache_path;
+	gchar *cache_tmp;
+	FILE *cache_out;
+
+	/* Identical GETs which arrived while this one was pending */
+	gchar *coalesce_key;
+	GSList *waiters;
+
+	/* Statistics; times are monotonic µs */
+	gint64 queued_time;
+	gint64 submit_time;
+	gint64 headers_time;
+	gint64 parse_time;
+	guint64 resp_bytes;
+	guint retries;
+
+	/* Transient failures so far, and the pending retry if any */
+	guint failures;
+	guint retry_timer;
 };
 
+/* Until we've seen a token expire, renew it this often (in seconds) */
+#define CHIME_TOKEN_RENEW_DEFAULT 3600
+#define CHIME_TOKEN_RENEW_MIN 60
+
+/* Beyond this, requests wait in our own priority queues rather than
+ * in libsoup's FIFO. */
+#define CHIME_MAX_INFLIGHT_PER_HOST 4
+
+/* Transient failures of idempotent requests are retried after a random
+ * delay between half and all of min(MAX, BASE * 2^n) ms. */
+#define CHIME_RETRY_BASE_MS 500
+#define CHIME_RETRY_MAX_MS 30000
+
 typedef struct {
 	ChimeConnectionState state;
 	GSList *amazon_cas;
@@ -104,6 +183,10 @@ typedef struct {
 	gchar *server;
 	gchar *device_token;
 	gchar *session_token;
+	gint64 token_time;	/* Monotonic time it was issued */
+	gint64 token_lifetime;	/* Shortest seen before a 401, or 0 */
+	guint renew_timer;
+	gboolean renewing;
 
 	gboolean jugg_online, contacts_online, rooms_online, convs_online, meetings_online;
 
@@ -133,16 +216,42 @@ typedef struct {
 
 	SoupSession *soup_sess;
 
-	/* Messages queued for resubmission */
+	/* Messages submitted to the SoupSession */
 	GQueue *msgs_queued;
 	GQueue *msgs_pending_auth;
 
+	/* Messages waiting for a free per-host slot, by priority */
+	GQueue *msgs_scheduled[CHIME_REQUEST_NR_PRIOS];
+	GHashTable *host_inflight;
+
+	/* Messages waiting to be retried after a transient failure */
+	GQueue *msgs_retrying;
+
+	/* Pending GETs which later identical requests can join, by URI */
+	GHashTable *msgs_coalesce;
+
+	gchar *cache_dir;
+
+	ChimeLogLevel log_level;
+	ChimeLogRing *log_ring;		/* NULL unless CHIME_LOG_RING is set */
+
+	/* Statistics */
+	GHashTable *endpoint_stats;
+	GHashTable *jugg_stats;		/* Channel → klass quark → stats */
+	guint stats_timer;
+
 	/* Juggernaut */
 	SoupWebsocketConnection *ws_conn;
 	gboolean jugg_connected;	/* For reconnecting, to abort on failed reconnect */
 	guint keepalive_timer;
 	gchar *ws_key;
 	GHashTable *subscriptions;
+	gint64 jugg_gap_start;		/* Real time the connection was lost, or 0 */
+	FILE *jugg_capture;
+	GString *jugg_acks;		/* Pending ack packets, each NUL-terminated */
+	guint jugg_nr_acks;
+	guint jugg_ack_source;
+	guint jugg_ack_window;		/* ms, or 0 for the next main loop iteration */
 
 	/* Contacts */
 	ChimeObjectCollection contacts;
@@ -153,6 +262,7 @@ typedef struct {
 	/* Rooms */
 	ChimeObjectCollection rooms;
 	ChimeSyncState rooms_sync;
+	gchar *rooms_resume_since;	/* Catch up once the room list is fetched */
 
 	/* Conversations */
 	ChimeObjectCollection conversations;
@@ -167,8 +277,6 @@ typedef struct {
 	(G_TYPE_INSTANCE_GET_PRIVATE ((o), CHIME_TYPE_CONNECTION, \
 				      ChimeConnectionPrivate))
 
-#define chime_debug(...) do { if (getenv("CHIME_DEBUG")) printf(__VA_ARGS__); } while (0)
-
 /* chime-websocket.c */
 /* Like the soup_session_ variants, but with the auth retry */
 void
@@ -194,12 +302,33 @@ void chime_connection_new_contact(ChimeConnection *cxn, ChimeContact *contact);
 void chime_connection_new_room(ChimeConnection *cxn, ChimeRoom *room);
 void chime_connection_new_conversation(ChimeConnection *cxn, ChimeConversation *conversation);
 void chime_connection_new_meeting(ChimeConnection *cxn, ChimeMeeting *meeting);
-void chime_connection_log(ChimeConnection *cxn, ChimeLogLevel level, const gchar *format, ...);
+/* Check the level before evaluating any of the arguments */
+gboolean chime_connection_log_enabled(ChimeConnection *cxn, ChimeLogLevel level);
+void chime_connection_do_log(ChimeConnection *cxn, ChimeLogLevel level, const gchar *format, ...)
+	G_GNUC_PRINTF(3, 4);
+#define chime_connection_log(cxn, level, ...)					\
+	do {									\
+		if (chime_connection_log_enabled((cxn), (level)))		\
+			chime_connection_do_log((cxn), (level), __VA_ARGS__);	\
+	} while (0)
 void chime_connection_progress(ChimeConnection *cxn, int percent, const gchar *message);
 SoupMessage *chime_connection_queue_http_request(ChimeConnection *self, JsonNode *node,
 						 SoupURI *uri, const gchar *method,
 						 ChimeSoupMessageCallback callback,
 						 gpointer cb_data);
+SoupMessage *chime_connection_queue_http_request_full(ChimeConnection *self, JsonNode *node,
+						      SoupURI *uri, const gchar *method,
+						      ChimeRequestPriority prio,
+						      ChimeSoupMessageCallback callback,
+						      gpointer cb_data);
+SoupMessage *chime_connection_queue_http_stream(ChimeConnection *self, JsonNode *node,
+						SoupURI *uri, const gchar *method,
+						ChimeRequestPriority prio,
+						ChimeHttpFlags flags,
+						const gchar *member,
+						ChimeSoupElementCallback elem_cb,
+						ChimeSoupMessageCallback callback,
+						gpointer cb_data);
 SoupURI *soup_uri_new_printf(const gchar *base, const gchar *format, ...);
 gboolean parse_notify_pref(JsonNode *node, const gchar *member, ChimeNotifyPref *type);
 gboolean parse_visibility(JsonNode *node, const gchar *member, gboolean *val);
@@ -222,6 +351,7 @@ gboolean chime_connection_jugg_send(ChimeConnection *self, JsonNode *node);
 /* chime-conversation.c */
 void chime_init_conversations(ChimeConnection *cxn);
 void chime_destroy_conversations(ChimeConnection *cxn);
+void chime_resume_conversations(ChimeConnection *cxn);
 
 /* chime-juggernaut.c */
 void chime_init_juggernaut(ChimeConnection *cxn);
@@ -235,10 +365,13 @@ void chime_jugg_subscribe(ChimeConnection *cxn, const gchar *channel,
 void chime_jugg_unsubscribe(ChimeConnection *cxn, const gchar *channel,
 			    const gchar *klass, JuggernautCallback cb,
 			    gpointer cb_data);
+void chime_jugg_replay_frame(ChimeConnection *cxn, const gchar *data, gsize len);
 
 /* chime-rooms.c */
 void chime_init_rooms(ChimeConnection *cxn);
 void chime_destroy_rooms(ChimeConnection *cxn);
+void chime_resume_rooms(ChimeConnection *cxn, const gchar *gap_start);
+void chime_room_note_message(ChimeRoom *room, JsonNode *record);
 gboolean chime_connection_fetch_room(ChimeConnection *cxn, const gchar *id,
 				     JuggernautCallback cb, gpointer cb_data);
 
@@ -262,7 +395,43 @@ gboolean chime_call_participant_audio_stats(ChimeCall *call, const gchar *profil
 /* chime-login.c */
 void chime_initial_login(ChimeConnection *cxn);
 
+/* chime-stats.c */
+#define CHIME_HISTOGRAM_BUCKETS 40
+
+/* Bucket n counts values in [2^n, 2^(n+1)); the last one has the rest */
+typedef struct {
+	guint64 count;
+	guint64 sum;
+	guint64 min;
+	guint64 max;
+	guint32 buckets[CHIME_HISTOGRAM_BUCKETS];
+} ChimeHistogram;
+
+void chime_histogram_add(ChimeHistogram *h, guint64 val);
+guint64 chime_histogram_quantile(ChimeHistogram *h, double q);
+void chime_histogram_build_json(ChimeHistogram *h, JsonBuilder *jb);
+
+void chime_init_stats(ChimeConnection *cxn);
+void chime_destroy_stats(ChimeConnection *cxn);
+void chime_stats_record_request(ChimeConnection *cxn, struct chime_msg *cmsg);
+guint64 chime_stats_cpu_ns(void);
+void chime_stats_record_jugg(ChimeConnection *cxn, const gchar *channel, const gchar *klass,
+			     gsize bytes, gboolean handled, guint64 cpu_ns);
+
+/* chime-http-cache.c */
+void chime_http_cache_prepare(ChimeConnection *cxn, struct chime_msg *cmsg);
+void chime_http_cache_got_headers(ChimeConnection *cxn, struct chime_msg *cmsg);
+void chime_http_cache_got_chunk(ChimeConnection *cxn, struct chime_msg *cmsg,
+				SoupBuffer *chunk);
+void chime_http_cache_complete(ChimeConnection *cxn, struct chime_msg *cmsg);
+GMappedFile *chime_http_cache_replay(ChimeConnection *cxn, struct chime_msg *cmsg);
+void chime_http_cache_forget(struct chime_msg *cmsg);
+void chime_http_cache_free(struct chime_msg *cmsg);
+
 /* chime-certs.c */
 GSList *chime_cert_list(void);
+GPtrArray *chime_cert_chain_from_tls(GTlsCertificate *cert);
+gboolean chime_cert_cache_lookup(GPtrArray *chain, const gchar *host);
+void chime_cert_cache_add(GPtrArray *chain, const gchar *host);
 
 #endif /* __CHIME_CONNECTION_PRIVATE_H__ */
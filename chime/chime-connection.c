@@ -53,6 +53,7 @@ G_DEFINE_QUARK(chime-error-quark, chime_error)
 G_DEFINE_TYPE(ChimeConnection, chime_connection, G_TYPE_OBJECT)
 
 static void soup_msg_cb(SoupSession *soup_sess, SoupMessage *msg, gpointer _cmsg);
+static void chime_token_renewed(ChimeConnection *self);
 
 static void
 chime_connection_finalize(GObject *object)
@@ -64,26 +65,105 @@ chime_connection_finalize(GObject *object)
 	g_free(priv->device_token);
 	g_free(priv->server);
 	g_free(priv->express_url);
+	g_hash_table_destroy(priv->host_inflight);
+	g_hash_table_destroy(priv->msgs_coalesce);
+	chime_destroy_stats(self);
 
 	chime_connection_log(self, CHIME_LOGLVL_MISC, "Connection finalized: %p\n", self);
+	chime_log_ring_free(priv->log_ring);
 
 	G_OBJECT_CLASS(chime_connection_parent_class)->finalize(object);
 }
 
+struct chime_msg_waiter {
+	ChimeSoupMessageCallback cb;
+	gpointer cb_data;
+};
+
+/* Only once cmsg_deliver() has told the requester and any waiters */
+static void
+cmsg_release(struct chime_msg *cmsg)
+{
+	if (cmsg->retry_timer)
+		g_source_remove(cmsg->retry_timer);
+	g_clear_pointer(&cmsg->stream, chime_json_stream_free);
+	chime_http_cache_free(cmsg);
+	g_slist_free_full(cmsg->waiters, g_free);
+	g_free(cmsg->coalesce_key);
+	g_free(cmsg);
+}
+
 static void
 cmsg_free(struct chime_msg *cmsg)
 {
 	g_object_unref(cmsg->msg);
-	g_free(cmsg);
+	cmsg_release(cmsg);
+}
+
+/* Hand the response to the original requester and to everyone whose
+ * identical GET was coalesced with it. */
+static void
+cmsg_deliver(struct chime_msg *cmsg, JsonNode *node)
+{
+	GSList *l;
+
+	if (cmsg->cb)
+		cmsg->cb(cmsg->cxn, cmsg->msg, node, cmsg->cb_data);
+
+	for (l = cmsg->waiters; l; l = l->next) {
+		struct chime_msg_waiter *w = l->data;
+
+		w->cb(cmsg->cxn, cmsg->msg, node, w->cb_data);
+	}
+}
+
+/* Complete a request which never reached the SoupSession just as
+ * soup_session_abort() completes those which did. */
+static void
+cmsg_cancel(struct chime_msg *cmsg)
+{
+	soup_message_set_status(cmsg->msg, SOUP_STATUS_CANCELLED);
+	cmsg_deliver(cmsg, NULL);
+	cmsg_free(cmsg);
+}
+
+/* The queue is emptied first, so callbacks are free to queue more
+ * requests (or even disconnect again) while this runs. */
+static void
+cancel_cmsgs(GQueue *q)
+{
+	GList *l, *list = q->head;
+
+	g_queue_init(q);
+	for (l = list; l; l = l->next)
+		cmsg_cancel(l->data);
+	g_list_free(list);
 }
 
 void
 chime_connection_disconnect(ChimeConnection    *self)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+	int i;
 
 	chime_connection_log(self, CHIME_LOGLVL_MISC, "Disconnecting connection: %p\n", self);
 
+	/* Nothing new gets to join requests which are about to be cancelled */
+	g_hash_table_remove_all(priv->msgs_coalesce);
+
+	/* Cancel anything still waiting for a slot before the abort below
+	 * completes the in-flight requests, or their completion would just
+	 * submit the next ones. Those waiting for a new token go first, so
+	 * that a cancelled renewal doesn't fail the connection for them. */
+	if (priv->msgs_pending_auth)
+		cancel_cmsgs(priv->msgs_pending_auth);
+	if (priv->msgs_retrying)
+		cancel_cmsgs(priv->msgs_retrying);
+	for (i = 0; i < CHIME_REQUEST_NR_PRIOS; i++) {
+		if (priv->msgs_scheduled[i])
+			cancel_cmsgs(priv->msgs_scheduled[i]);
+	}
+
 	if (priv->soup_sess) {
 		soup_session_abort(priv->soup_sess);
 		g_clear_object(&priv->soup_sess);
@@ -99,13 +179,32 @@ chime_connection_disconnect(ChimeConnection    *self)
 	g_clear_pointer(&priv->reg_node, json_node_unref);
 
 	if (priv->msgs_pending_auth) {
-		g_queue_free_full(priv->msgs_pending_auth, (GDestroyNotify)cmsg_free);
-		priv->msgs_pending_auth = NULL;
+		cancel_cmsgs(priv->msgs_pending_auth);
+		g_clear_pointer(&priv->msgs_pending_auth, g_queue_free);
+	}
+	if (priv->msgs_retrying) {
+		cancel_cmsgs(priv->msgs_retrying);
+		g_clear_pointer(&priv->msgs_retrying, g_queue_free);
 	}
 	if (priv->msgs_queued) {
 		g_queue_free(priv->msgs_queued);
 		priv->msgs_queued = NULL;
 	}
+	for (i = 0; i < CHIME_REQUEST_NR_PRIOS; i++) {
+		if (priv->msgs_scheduled[i]) {
+			cancel_cmsgs(priv->msgs_scheduled[i]);
+			g_clear_pointer(&priv->msgs_scheduled[i], g_queue_free);
+		}
+	}
+	g_hash_table_remove_all(priv->host_inflight);
+	g_hash_table_remove_all(priv->msgs_coalesce);
+	g_clear_pointer(&priv->cache_dir, g_free);
+
+	if (priv->renew_timer) {
+		g_source_remove(priv->renew_timer);
+		priv->renew_timer = 0;
+	}
+	priv->renewing = FALSE;
 
 	if (priv->state != CHIME_STATE_DISCONNECTED)
 		g_signal_emit(self, signals[DISCONNECTED], 0, NULL);
@@ -285,10 +384,14 @@ chime_connection_class_init(ChimeConnectionClass *klass)
 			      0, NULL, NULL, NULL, G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_STRING);
 }
 
+static void dump_log_ring(ChimeConnection *cxn);
+
 void chime_connection_fail_error(ChimeConnection *cxn, GError *error)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
 
+	dump_log_ring(cxn);
+
 	priv->state = CHIME_STATE_DISCONNECTED;
 	g_signal_emit(cxn, signals[DISCONNECTED], 0, error);
 
@@ -330,11 +433,23 @@ req_started_cb(SoupSession *sess, SoupMessage *msg, SoupSocket *sock, gpointer _
 		/* The identity part shouldn't be needed but there's no
 		 * real harm in being paranoid and checking it again. */
 		SoupURI *uri = soup_message_get_uri(msg);
-		GSocketConnectable *ident = g_network_address_new(soup_uri_get_host(uri),
-								  soup_uri_get_port(uri));
-
+		const gchar *host = soup_uri_get_host(uri);
 		GTlsCertificate *cert;
+		GPtrArray *chain;
+
 		g_object_get(sock, "tls-certificate", &cert, NULL);
+		if (!cert)
+			goto fail;
+		chain = chime_cert_chain_from_tls(cert);
+
+		/* We've seen this one before */
+		if (chime_cert_cache_lookup(chain, host)) {
+			g_ptr_array_unref(chain);
+			g_object_unref(cert);
+			return;
+		}
+
+		GSocketConnectable *ident = g_network_address_new(host, soup_uri_get_port(uri));
 
 		GSList *l = priv->amazon_cas;
 		while (l && cert_errors) {
@@ -343,12 +458,18 @@ req_started_cb(SoupSession *sess, SoupMessage *msg, SoupSocket *sock, gpointer _
 		}
 		g_object_unref(ident);
 
+		if (!cert_errors)
+			chime_cert_cache_add(chain, host);
+
+		g_ptr_array_unref(chain);
+		g_object_unref(cert);
+
 		if (!cert_errors) {
-			chime_debug("Allow Amazon CA for %s\n", soup_uri_get_host(uri));
+			chime_debug("Allow Amazon CA for %s\n", host);
 			return;
 		}
 	}
-
+ fail:
 	/* Don't like the server's cert. Fail the message. */
 	soup_session_cancel_message(sess, msg, SOUP_STATUS_SSL_FAILED);
 }
@@ -357,10 +478,16 @@ static void
 chime_connection_init(ChimeConnection *self)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+	int i;
+
 	priv->soup_sess = soup_session_new();
 	priv->amazon_cas = chime_cert_list();
 
-	if (getenv("CHIME_DEBUG") && atoi(getenv("CHIME_DEBUG")) > 0) {
+	/* The consumer can ask for more (or less) with chime_connection_set_log_level() */
+	priv->log_level = chime_debug_level() >= 0 ? CHIME_LOGLVL_MISC : CHIME_LOGLVL_INFO;
+	priv->log_ring = chime_log_ring_new();
+
+	if (chime_debug_level() > 0) {
 		SoupLogger *l = soup_logger_new(SOUP_LOGGER_LOG_BODY, -1);
 		soup_session_add_feature(priv->soup_sess, SOUP_SESSION_FEATURE(l));
 		g_object_unref(l);
@@ -374,8 +501,18 @@ chime_connection_init(ChimeConnection *self)
 	g_object_set(priv->soup_sess, "ssl-strict", FALSE, NULL);
 	g_signal_connect(G_OBJECT(priv->soup_sess), "request-started", G_CALLBACK(req_started_cb), self);
 
+	/* We do our own per-host limiting and prioritisation in front of
+	 * the session; don't let libsoup serialise below that. */
+	g_object_set(priv->soup_sess, "max-conns-per-host", CHIME_MAX_INFLIGHT_PER_HOST, NULL);
+
 	priv->msgs_pending_auth = g_queue_new();
 	priv->msgs_queued = g_queue_new();
+	priv->msgs_retrying = g_queue_new();
+	for (i = 0; i < CHIME_REQUEST_NR_PRIOS; i++)
+		priv->msgs_scheduled[i] = g_queue_new();
+	priv->host_inflight = g_hash_table_new(g_direct_hash, g_direct_equal);
+	priv->msgs_coalesce = g_hash_table_new(g_str_hash, g_str_equal);
+	chime_init_stats(self);
 	priv->state = CHIME_STATE_DISCONNECTED;
 }
 
@@ -410,6 +547,7 @@ static gboolean parse_regnode(ChimeConnection *self, JsonNode *regnode)
 		return FALSE;
 
 	chime_connection_set_session_token(self, sess_tok);
+	chime_token_renewed(self);
 
 	if (!parse_string(sess_node, "SessionId", &priv->session_id))
 		return FALSE;
@@ -508,6 +646,8 @@ chime_device_register_req(const gchar *devtoken)
 	return jn;
 }
 
+static void prewarm_hosts(ChimeConnection *self);
+
 static void register_cb(ChimeConnection *self, SoupMessage *msg,
 			JsonNode *node, gpointer user_data)
 {
@@ -537,6 +677,8 @@ static void register_cb(ChimeConnection *self, SoupMessage *msg,
 	chime_init_conversations(self);
 	chime_init_calls(self);
 	chime_init_meetings(self);
+
+	prewarm_hosts(self);
 }
 
 void chime_connection_calculate_online(ChimeConnection *self)
@@ -696,17 +838,223 @@ chime_connection_set_session_token(ChimeConnection *self,
 	}
 }
 
+static guint host_inflight(ChimeConnectionPrivate *priv, const gchar *host)
+{
+	return GPOINTER_TO_UINT(g_hash_table_lookup(priv->host_inflight, host));
+}
+
+/* Whatever the answer, the connection is now in the pool. It isn't worth
+ * renewing the token or retrying for, so soup_msg_cb() doesn't. */
+static void prewarm_cb(ChimeConnection *cxn, SoupMessage *msg,
+		       JsonNode *node, gpointer _unused)
+{
+	chime_debug("Prewarmed connection to %s (%d)\n",
+		    soup_uri_get_host(soup_message_get_uri(msg)), msg->status_code);
+}
+
+/* Each of the service hosts would otherwise pay for DNS, TCP and TLS on
+ * its first request, which for some of them is only made well into the
+ * connection setup (or not until the user does something). So for each
+ * host which isn't already being connected to for a real request, make
+ * a cheap request to get a connection into the SoupSession's pool. These
+ * go through the request queues like any other, so they count against
+ * the per-host limit. The Juggernaut WebSocket gets a connection of its
+ * own, so there's no point in doing it for that. */
+static void prewarm_hosts(ChimeConnection *self)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+	const gchar *urls[] = {
+		priv->presence_url, priv->contacts_url, priv->messaging_url,
+		priv->profile_url, priv->conference_url,
+	};
+	GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(urls); i++) {
+		SoupURI *uri = soup_uri_new(urls[i]);
+		const gchar *host;
+
+		if (!uri)
+			continue;
+
+		host = g_intern_string(soup_uri_get_host(uri));
+		if (!host || g_hash_table_contains(seen, host) || host_inflight(priv, host)) {
+			soup_uri_free(uri);
+			continue;
+		}
+		g_hash_table_add(seen, (gpointer)host);
+
+		soup_uri_set_path(uri, "/");
+		soup_uri_set_query(uri, NULL);
+		chime_connection_queue_http_request_full(self, NULL, uri, "HEAD",
+							 CHIME_REQUEST_BACKGROUND,
+							 prewarm_cb, NULL);
+	}
+
+	g_hash_table_destroy(seen);
+}
+
+static void set_auth_headers(ChimeConnection *self, SoupMessage *msg)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	if (priv->session_token) {
+		gchar *cookie = g_strdup_printf("_aws_wt_session=%s", priv->session_token);
+		soup_message_headers_replace(msg->request_headers, "Cookie", cookie);
+		soup_message_headers_replace(msg->request_headers, "X-Chime-Auth-Token", cookie);
+		g_free(cookie);
+	} else {
+		soup_message_headers_remove(msg->request_headers, "Cookie");
+		soup_message_headers_remove(msg->request_headers, "X-Chime-Auth-Token");
+	}
+}
+
+/* The auth headers are added only as each request is handed to the
+ * SoupSession, so a renewed token takes effect immediately for
+ * everything which hasn't yet gone out. */
+static void submit_cmsg(ChimeConnection *self, struct chime_msg *cmsg)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	set_auth_headers(self, cmsg->msg);
+
+	if (cmsg->submit_time)
+		cmsg->retries++;
+	cmsg->submit_time = g_get_monotonic_time();
+
+	g_hash_table_insert(priv->host_inflight, (gpointer)cmsg->host,
+			    GUINT_TO_POINTER(host_inflight(priv, cmsg->host) + 1));
+	g_queue_push_tail(priv->msgs_queued, cmsg);
+	g_object_ref(self);
+	soup_session_queue_message(priv->soup_sess, cmsg->msg, soup_msg_cb, cmsg);
+}
+
+static void cmsg_completed(ChimeConnectionPrivate *priv, struct chime_msg *cmsg)
+{
+	guint count;
+
+	if (!priv->msgs_queued || !g_queue_remove(priv->msgs_queued, cmsg))
+		return;
+
+	count = host_inflight(priv, cmsg->host);
+	if (count > 1)
+		g_hash_table_insert(priv->host_inflight, (gpointer)cmsg->host,
+				    GUINT_TO_POINTER(count - 1));
+	else
+		g_hash_table_remove(priv->host_inflight, cmsg->host);
+}
+
+/* Hand as many scheduled requests to the SoupSession as the per-host limit
+ * allows, strictly in priority order for any given host. A busy host does
+ * not block requests to other hosts from going out. */
+static void run_request_queues(ChimeConnection *self)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+	int i;
+
+	for (i = 0; i < CHIME_REQUEST_NR_PRIOS; i++) {
+		GQueue *q = priv->msgs_scheduled[i];
+		GList *l, *next;
+
+		if (!q)
+			return;
+
+		for (l = q->head; l; l = next) {
+			struct chime_msg *cmsg = l->data;
+
+			next = l->next;
+			if (host_inflight(priv, cmsg->host) >= CHIME_MAX_INFLIGHT_PER_HOST)
+				continue;
+
+			g_queue_delete_link(q, l);
+			submit_cmsg(self, cmsg);
+		}
+	}
+}
+
+guint chime_connection_get_queue_depth(ChimeConnection *self, ChimeRequestPriority prio)
+{
+	g_return_val_if_fail(CHIME_IS_CONNECTION(self), 0);
+	g_return_val_if_fail(prio < CHIME_REQUEST_NR_PRIOS, 0);
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	return priv->msgs_scheduled[prio] ? g_queue_get_length(priv->msgs_scheduled[prio]) : 0;
+}
+
+guint chime_connection_get_requests_in_flight(ChimeConnection *self)
+{
+	g_return_val_if_fail(CHIME_IS_CONNECTION(self), 0);
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	return priv->msgs_queued ? g_queue_get_length(priv->msgs_queued) : 0;
+}
+
+static void chime_renew_token(ChimeConnection *self);
+static void renew_cb(ChimeConnection *self, SoupMessage *msg,
+		     JsonNode *node, gpointer _unused);
+
+static gboolean renew_timer_cb(gpointer _self)
+{
+	ChimeConnection *self = _self;
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	priv->renew_timer = 0;
+	chime_connection_log(self, CHIME_LOGLVL_MISC, "Renewing session token before expiry\n");
+	chime_renew_token(self);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void schedule_token_renewal(ChimeConnection *self, guint secs)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	if (priv->renew_timer)
+		g_source_remove(priv->renew_timer);
+	priv->renew_timer = g_timeout_add_seconds(secs, renew_timer_cb, self);
+}
+
+/* We have no idea when a session token expires, except by experience.
+ * Renew after three quarters of the shortest lifetime we have seen, or
+ * after CHIME_TOKEN_RENEW_DEFAULT if we haven't seen one expire yet. */
+static void chime_token_renewed(ChimeConnection *self)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+	guint secs = CHIME_TOKEN_RENEW_DEFAULT;
+
+	priv->token_time = g_get_monotonic_time();
+
+	if (priv->token_lifetime)
+		secs = MAX(priv->token_lifetime * 3 / 4 / G_USEC_PER_SEC,
+			   CHIME_TOKEN_RENEW_MIN);
+
+	schedule_token_renewal(self, secs);
+}
+
 /* If we get an auth failure on a standard request, we automatically attempt
- * to renew the authentication token and resubmit the request. */
+ * to renew the authentication token and resubmit the request. We also renew
+ * it in the background before it is expected to expire, in which case
+ * requests carry on using the old one until the new one arrives. */
 static void renew_cb(ChimeConnection *self, SoupMessage *msg,
 		     JsonNode *node, gpointer _unused)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
 	struct chime_msg *cmsg = NULL;
 	const gchar *sess_tok;
-	gchar *cookie_hdr;
+
+	priv->renewing = FALSE;
 
 	if (!node || !parse_string(node, "SessionToken", &sess_tok)) {
+		/* If we were renewing ahead of time, the old token is still
+		 * good. Try again in a while. */
+		if (priv->state != CHIME_STATE_DISCONNECTED &&
+		    g_queue_is_empty(priv->msgs_pending_auth)) {
+			chime_connection_log(self, CHIME_LOGLVL_MISC,
+					     "Failed to renew session token (%d); will retry\n",
+					     msg->status_code);
+			schedule_token_renewal(self, CHIME_TOKEN_RENEW_MIN);
+			return;
+		}
 		chime_connection_fail(self, CHIME_ERROR_NETWORK,
 				      _("Failed to renew session token"));
 		chime_connection_set_session_token(self, NULL);
@@ -718,21 +1066,16 @@ static void renew_cb(ChimeConnection *self, SoupMessage *msg,
 	if (priv->state == CHIME_STATE_DISCONNECTED)
 		return;
 
-	cookie_hdr = g_strdup_printf("_aws_wt_session=%s", priv->session_token);
+	chime_token_renewed(self);
 
+	/* submit_cmsg() will give them the new token */
 	while ( (cmsg = g_queue_pop_head(priv->msgs_pending_auth)) ) {
-		soup_message_headers_replace(cmsg->msg->request_headers,
-					     "Cookie", cookie_hdr);
-		soup_message_headers_replace(cmsg->msg->request_headers,
-					     "X-Chime-Auth-Token", cookie_hdr);
 		chime_connection_log(self, CHIME_LOGLVL_MISC, "Requeued %p to %s\n", cmsg->msg,
 				     soup_uri_get_path(soup_message_get_uri(cmsg->msg)));
-		g_object_ref(self);
-		soup_session_queue_message(priv->soup_sess, cmsg->msg,
-					   soup_msg_cb, cmsg);
+		g_queue_push_tail(priv->msgs_scheduled[cmsg->prio], cmsg);
 	}
 
-	g_free(cookie_hdr);
+	run_request_queues(self);
 }
 
 static void chime_renew_token(ChimeConnection *self)
@@ -742,6 +1085,15 @@ static void chime_renew_token(ChimeConnection *self)
 	JsonBuilder *builder;
 	JsonNode *node;
 
+	if (priv->renewing)
+		return;
+	priv->renewing = TRUE;
+
+	if (priv->renew_timer) {
+		g_source_remove(priv->renew_timer);
+		priv->renew_timer = 0;
+	}
+
 	builder = json_builder_new();
 	builder = json_builder_begin_object(builder);
 	builder = json_builder_set_member_name(builder, "Token");
@@ -751,12 +1103,150 @@ static void chime_renew_token(ChimeConnection *self)
 
 	uri = soup_uri_new_printf(priv->profile_url, "/tokens");
 	soup_uri_set_query_from_fields(uri, "Token", priv->session_token, NULL);
-	chime_connection_queue_http_request(self, node, uri, "POST", renew_cb, NULL);
+	chime_connection_queue_http_request_full(self, node, uri, "POST", CHIME_REQUEST_INTERACTIVE,
+						 renew_cb, NULL);
 
 	json_node_unref(node);
 	g_object_unref(builder);
 }
 
+static void stream_element_cb(JsonNode *node, gpointer _cmsg)
+{
+	struct chime_msg *cmsg = _cmsg;
+
+	cmsg->streamed = TRUE;
+	cmsg->elem_cb(cmsg->cxn, cmsg->msg, node, cmsg->cb_data);
+}
+
+/* Successful responses with validators are written to the cache as they
+ * arrive. Only successful JSON responses are streamed. Anything else
+ * (errors, and the 401 which gets resubmitted after renewing the token)
+ * is accumulated and handled as a normal response in soup_msg_cb(). */
+static void got_headers_cb(SoupMessage *msg, gpointer _cmsg)
+{
+	struct chime_msg *cmsg = _cmsg;
+	const gchar *content_type = soup_message_headers_get_content_type(msg->response_headers, NULL);
+
+	cmsg->headers_time = g_get_monotonic_time();
+	cmsg->resp_bytes = 0;
+
+	chime_http_cache_got_headers(cmsg->cxn, cmsg);
+
+	if (!cmsg->elem_cb)
+		return;
+
+	g_clear_pointer(&cmsg->stream, chime_json_stream_free);
+
+	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) &&
+	    !g_strcmp0(content_type, "application/json")) {
+		cmsg->stream = chime_json_stream_new(cmsg->stream_member,
+						     stream_element_cb, cmsg);
+		soup_message_body_set_accumulate(msg->response_body, FALSE);
+	} else {
+		soup_message_body_set_accumulate(msg->response_body, TRUE);
+	}
+}
+
+static void got_chunk_cb(SoupMessage *msg, SoupBuffer *chunk, gpointer _cmsg)
+{
+	struct chime_msg *cmsg = _cmsg;
+
+	cmsg->resp_bytes += chunk->length;
+
+	chime_http_cache_got_chunk(cmsg->cxn, cmsg, chunk);
+
+	if (cmsg->stream)
+		chime_json_stream_feed(cmsg->stream, chunk->data, chunk->length);
+}
+
+/* How many times a request may fail transiently before we give up and
+ * let its callback see the error. The user is waiting for interactive
+ * requests; the others would otherwise mean a full reconnect. */
+static const guint retry_budget[CHIME_REQUEST_NR_PRIOS] = {
+	[CHIME_REQUEST_INTERACTIVE] = 2,
+	[CHIME_REQUEST_MESSAGES] = 5,
+	[CHIME_REQUEST_BACKGROUND] = 8,
+};
+
+static gboolean is_transient_failure(SoupMessage *msg)
+{
+	switch (msg->status_code) {
+	case SOUP_STATUS_CANT_RESOLVE:
+	case SOUP_STATUS_CANT_CONNECT:
+	case SOUP_STATUS_IO_ERROR:
+	case SOUP_STATUS_REQUEST_TIMEOUT:
+	case 429: /* Too Many Requests */
+	case SOUP_STATUS_INTERNAL_SERVER_ERROR:
+	case SOUP_STATUS_BAD_GATEWAY:
+	case SOUP_STATUS_SERVICE_UNAVAILABLE:
+	case SOUP_STATUS_GATEWAY_TIMEOUT:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static gboolean retry_timer_cb(gpointer _cmsg)
+{
+	struct chime_msg *cmsg = _cmsg;
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cmsg->cxn);
+
+	cmsg->retry_timer = 0;
+	g_queue_remove(priv->msgs_retrying, cmsg);
+	g_queue_push_tail(priv->msgs_scheduled[cmsg->prio], cmsg);
+	run_request_queues(cmsg->cxn);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Anything which is safe to repeat gets another go after a transient
+ * failure, until its budget runs out. That's GET and HEAD, and anything
+ * the caller has marked CHIME_HTTP_IDEMPOTENT. Once elements of a streamed
+ * response have been delivered, the consumers have acted on them, so the
+ * error goes to the callback rather than delivering them again. */
+static gboolean maybe_retry(ChimeConnection *cxn, struct chime_msg *cmsg)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	SoupMessage *msg = cmsg->msg;
+	const gchar *retry_after;
+	guint delay;
+
+	if (!priv->msgs_retrying || cmsg->cb == prewarm_cb)
+		return FALSE;
+
+	if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD &&
+	    !(cmsg->flags & CHIME_HTTP_IDEMPOTENT))
+		return FALSE;
+
+	if (cmsg->streamed)
+		return FALSE;
+
+	if (!is_transient_failure(msg) || cmsg->failures >= retry_budget[cmsg->prio])
+		return FALSE;
+
+	delay = MIN(CHIME_RETRY_MAX_MS, CHIME_RETRY_BASE_MS << MIN(cmsg->failures, 16));
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+
+	/* The server may know better */
+	retry_after = soup_message_headers_get_one(msg->response_headers, "Retry-After");
+	if (retry_after && atoi(retry_after) > 0)
+		delay = MAX(delay, MIN(CHIME_RETRY_MAX_MS, atoi(retry_after) * 1000));
+
+	cmsg->failures++;
+	chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+			     "%s %s failed (%d %s); retry %u in %ums\n",
+			     msg->method, soup_uri_get_path(soup_message_get_uri(msg)),
+			     msg->status_code, msg->reason_phrase,
+			     cmsg->failures, delay);
+
+	g_clear_pointer(&cmsg->stream, chime_json_stream_free);
+
+	g_object_ref(msg);
+	g_queue_push_tail(priv->msgs_retrying, cmsg);
+	cmsg->retry_timer = g_timeout_add(delay, retry_timer_cb, cmsg);
+	return TRUE;
+}
+
 /* First callback for SoupMessage completion — do the common
  * parsing of the JSON response (if any) and hand it on to the
  * real callback function. Also handles auth token renewal. */
@@ -767,16 +1257,45 @@ static void soup_msg_cb(SoupSession *soup_sess, SoupMessage *msg, gpointer _cmsg
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
 	JsonParser *parser = NULL;
 	JsonNode *node = NULL;
+	JsonNode *stream_node = NULL;
 
-	if (priv->msgs_queued)
-		g_queue_remove(priv->msgs_queued, cmsg);
+	cmsg_completed(priv, cmsg);
 
 	/* Special case for renew_cb itself, which mustn't recurse! */
 	if (priv->state != CHIME_STATE_DISCONNECTED &&
-	    cmsg->cb != renew_cb && cmsg->cb != register_cb &&
+	    cmsg->cb != renew_cb && cmsg->cb != register_cb && cmsg->cb != prewarm_cb &&
 	    (msg->status_code == 401 /*||
 	     (msg->status_code == 7 && !g_queue_is_empty(priv->msgs_pending_auth))*/)) {
 		g_object_ref(msg);
+		g_clear_pointer(&cmsg->stream, chime_json_stream_free);
+
+		/* If it went out with a token we've since replaced, just send
+		 * it again; submit_cmsg() will use the new one. */
+		const gchar *sent_tok = soup_message_headers_get_one(msg->request_headers,
+								     "X-Chime-Auth-Token");
+		if (sent_tok && priv->session_token && g_queue_is_empty(priv->msgs_pending_auth) &&
+		    g_str_has_prefix(sent_tok, "_aws_wt_session=") &&
+		    strcmp(sent_tok + strlen("_aws_wt_session="), priv->session_token)) {
+			g_queue_push_tail(priv->msgs_scheduled[cmsg->prio], cmsg);
+			run_request_queues(cxn);
+			g_object_unref(cxn);
+			return;
+		}
+
+		/* We were too late. Remember how long the token actually
+		 * lasted, and renew sooner next time. */
+		if (priv->token_time) {
+			gint64 age = g_get_monotonic_time() - priv->token_time;
+
+			if (!priv->token_lifetime || age < priv->token_lifetime) {
+				priv->token_lifetime = age;
+				chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+						     "Session token expired after %" G_GINT64_FORMAT "s\n",
+						     age / G_USEC_PER_SEC);
+			}
+			priv->token_time = 0;
+		}
+
 		gboolean already_renewing = !g_queue_is_empty(priv->msgs_pending_auth);
 		g_queue_push_tail(priv->msgs_pending_auth, cmsg);
 		if (!already_renewing) {
@@ -790,14 +1309,68 @@ static void soup_msg_cb(SoupSession *soup_sess, SoupMessage *msg, gpointer _cmsg
 #endif
 			chime_renew_token(cxn);
 		}
+		run_request_queues(cxn);
 		g_object_unref(cxn);
 		return;
 	}
 
+	if (priv->state != CHIME_STATE_DISCONNECTED && maybe_retry(cxn, cmsg)) {
+		run_request_queues(cxn);
+		g_object_unref(cxn);
+		return;
+	}
+
+	chime_http_cache_complete(cxn, cmsg);
+
+	if (msg->status_code == SOUP_STATUS_NOT_MODIFIED && cmsg->cache_path) {
+		GMappedFile *body = chime_http_cache_replay(cxn, cmsg);
+
+		if (!body) {
+			chime_http_cache_forget(cmsg);
+			g_object_ref(msg);
+			g_queue_push_tail(priv->msgs_scheduled[cmsg->prio], cmsg);
+			run_request_queues(cxn);
+			g_object_unref(cxn);
+			return;
+		}
+
+		const gchar *data = g_mapped_file_get_contents(body);
+		gsize len = g_mapped_file_get_length(body);
+
+		if (cmsg->elem_cb) {
+			cmsg->stream = chime_json_stream_new(cmsg->stream_member,
+							     stream_element_cb, cmsg);
+			chime_json_stream_feed(cmsg->stream, data, len);
+		} else if (len) {
+			soup_message_body_append(msg->response_body, SOUP_MEMORY_COPY, data, len);
+			soup_buffer_free(soup_message_body_flatten(msg->response_body));
+		}
+		g_mapped_file_unref(body);
+	}
+
+	/* From here on, the response is final. A new request for the same
+	 * URI (perhaps from one of the callbacks) must go to the server. */
+	if (cmsg->coalesce_key &&
+	    g_hash_table_lookup(priv->msgs_coalesce, cmsg->coalesce_key) == cmsg)
+		g_hash_table_remove(priv->msgs_coalesce, cmsg->coalesce_key);
+
 	const gchar *content_type = soup_message_headers_get_content_type(msg->response_headers, NULL);
-	if (!g_strcmp0(content_type, "application/json") && msg->response_body->data) {
+	if (cmsg->stream) {
+		GError *error = NULL;
+
+		/* The elements have already gone to cmsg->elem_cb */
+		stream_node = node = chime_json_stream_finish(cmsg->stream, &error);
+		if (!node) {
+			g_warning("Error loading data: %s", error->message);
+			g_error_free(error);
+		}
+		cmsg->parse_time = chime_json_stream_get_parse_time(cmsg->stream);
+		g_clear_pointer(&cmsg->stream, chime_json_stream_free);
+	} else if (!g_strcmp0(content_type, "application/json") && msg->response_body->data) {
 		GError *error = NULL;
 
+		gint64 start = g_get_monotonic_time();
+
 		parser = json_parser_new();
 		if (!json_parser_load_from_data(parser, msg->response_body->data, msg->response_body->length, &error)) {
 			g_warning("Error loading data: %s", error->message);
@@ -805,42 +1378,103 @@ static void soup_msg_cb(SoupSession *soup_sess, SoupMessage *msg, gpointer _cmsg
 		} else {
 			node = json_parser_get_root(parser);
 		}
+		cmsg->parse_time = g_get_monotonic_time() - start;
 	}
 
-	if (cmsg->cb)
-		cmsg->cb(cmsg->cxn, msg, node, cmsg->cb_data);
+	chime_stats_record_request(cxn, cmsg);
+
+	cmsg_deliver(cmsg, node);
 	g_clear_object(&parser);
-	g_free(cmsg);
+	if (stream_node)
+		json_node_unref(stream_node);
+	cmsg_release(cmsg);
+
+	/* Now the callback has had a chance to queue any follow-up
+	 * requests, fill the slot we just freed. */
+	run_request_queues(cxn);
 	g_object_unref(cxn);
 }
 
+/* Like chime_connection_queue_http_request_full(), but the elements of the
+ * array @member of the response (or of the response itself, if @member is
+ * NULL) are handed to @elem_cb one at a time as they arrive. The final
+ * @callback then gets the rest of the response, with that array empty. */
 SoupMessage *
-chime_connection_queue_http_request(ChimeConnection *self, JsonNode *node,
-				    SoupURI *uri, const gchar *method,
-				    ChimeSoupMessageCallback callback,
-				    gpointer cb_data)
+chime_connection_queue_http_stream(ChimeConnection *self, JsonNode *node,
+				   SoupURI *uri, const gchar *method,
+				   ChimeRequestPriority prio,
+				   ChimeHttpFlags flags,
+				   const gchar *member,
+				   ChimeSoupElementCallback elem_cb,
+				   ChimeSoupMessageCallback callback,
+				   gpointer cb_data)
 {
 	g_return_val_if_fail(CHIME_IS_CONNECTION(self), NULL);
 	g_return_val_if_fail(SOUP_URI_IS_VALID(uri), NULL);
+	g_return_val_if_fail(prio < CHIME_REQUEST_NR_PRIOS, NULL);
 
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
-	struct chime_msg *cmsg = g_new0(struct chime_msg, 1);
+	gchar *coalesce_key = NULL;
+	struct chime_msg *cmsg;
+
+	/* A plain GET for something we're already fetching just waits for
+	 * the same response. Streamed requests can't join once their
+	 * elements have started to be delivered, so don't bother. */
+	if (!node && !elem_cb && callback && !strcmp(method, "GET")) {
+		coalesce_key = soup_uri_to_string(uri, FALSE);
+		cmsg = g_hash_table_lookup(priv->msgs_coalesce, coalesce_key);
+		if (cmsg) {
+			struct chime_msg_waiter *w = g_new0(struct chime_msg_waiter, 1);
+
+			w->cb = callback;
+			w->cb_data = cb_data;
+			cmsg->waiters = g_slist_append(cmsg->waiters, w);
+
+			chime_connection_log(self, CHIME_LOGLVL_MISC, "Coalesced GET %s\n",
+					     soup_uri_get_path(uri));
+
+			/* If it hasn't been sent yet, it goes at the more urgent priority */
+			if (prio < cmsg->prio &&
+			    g_queue_remove(priv->msgs_scheduled[cmsg->prio], cmsg)) {
+				cmsg->prio = prio;
+				g_queue_push_tail(priv->msgs_scheduled[prio], cmsg);
+				run_request_queues(self);
+			}
 
+			g_free(coalesce_key);
+			soup_uri_free(uri);
+			return cmsg->msg;
+		}
+	}
+
+	cmsg = g_new0(struct chime_msg, 1);
+	cmsg->queued_time = g_get_monotonic_time();
 	cmsg->cxn = self;
 	cmsg->cb = callback;
 	cmsg->cb_data = cb_data;
+	cmsg->prio = prio;
+	cmsg->host = g_intern_string(soup_uri_get_host(uri));
 	cmsg->msg = soup_message_new_from_uri(method, uri);
 	soup_uri_free(uri);
 
-	if (priv->session_token) {
-		gchar *cookie = g_strdup_printf("_aws_wt_session=%s", priv->session_token);
-		soup_message_headers_append(cmsg->msg->request_headers, "Cookie", cookie);
-		soup_message_headers_append(cmsg->msg->request_headers, "X-Chime-Auth-Token", cookie);
-		g_free(cookie);
+	cmsg->flags = flags;
+	cmsg->stream_member = member;
+	cmsg->elem_cb = elem_cb;
+
+	if (coalesce_key) {
+		cmsg->coalesce_key = coalesce_key;
+		g_hash_table_insert(priv->msgs_coalesce, coalesce_key, cmsg);
 	}
 
 	soup_message_headers_append(cmsg->msg->request_headers, "Accept", "*/*");
 	soup_message_headers_append(cmsg->msg->request_headers, "User-Agent", "Pidgin-Chime " PACKAGE_VERSION);
+
+	if ((flags & CHIME_HTTP_CACHE) && !strcmp(method, "GET"))
+		chime_http_cache_prepare(self, cmsg);
+
+	g_signal_connect(cmsg->msg, "got-headers", G_CALLBACK(got_headers_cb), cmsg);
+	g_signal_connect(cmsg->msg, "got-chunk", G_CALLBACK(got_chunk_cb), cmsg);
+
 	if (node) {
 		gchar *body;
 		gsize body_size;
@@ -859,14 +1493,40 @@ chime_connection_queue_http_request(ChimeConnection *self, JsonNode *node,
 	if (cmsg->cb != renew_cb && !g_queue_is_empty(priv->msgs_pending_auth))
 		g_queue_push_tail(priv->msgs_pending_auth, cmsg);
 	else {
-		g_queue_push_tail(priv->msgs_queued, cmsg);
-		g_object_ref(self);
-		soup_session_queue_message(priv->soup_sess, cmsg->msg, soup_msg_cb, cmsg);
+		g_queue_push_tail(priv->msgs_scheduled[prio], cmsg);
+		run_request_queues(self);
 	}
 
 	return cmsg->msg;
 }
 
+SoupMessage *
+chime_connection_queue_http_request_full(ChimeConnection *self, JsonNode *node,
+					 SoupURI *uri, const gchar *method,
+					 ChimeRequestPriority prio,
+					 ChimeSoupMessageCallback callback,
+					 gpointer cb_data)
+{
+	return chime_connection_queue_http_stream(self, node, uri, method, prio, 0,
+						  NULL, NULL, callback, cb_data);
+}
+
+/* By default, anything which changes state on the server is something the
+ * user is waiting for; plain GETs are background sync unless the caller
+ * says otherwise. */
+SoupMessage *
+chime_connection_queue_http_request(ChimeConnection *self, JsonNode *node,
+				    SoupURI *uri, const gchar *method,
+				    ChimeSoupMessageCallback callback,
+				    gpointer cb_data)
+{
+	ChimeRequestPriority prio = strcmp(method, "GET") ?
+		CHIME_REQUEST_INTERACTIVE : CHIME_REQUEST_BACKGROUND;
+
+	return chime_connection_queue_http_request_full(self, node, uri, method, prio,
+							callback, cb_data);
+}
+
 void chime_connection_new_contact(ChimeConnection *cxn, ChimeContact *contact)
 {
 	g_signal_emit(cxn, signals[NEW_CONTACT], 0, contact);
@@ -887,18 +1547,61 @@ void chime_connection_new_meeting(ChimeConnection *cxn, ChimeMeeting *meeting)
 	g_signal_emit(cxn, signals[NEW_MEETING], 0, meeting);
 }
 
-void chime_connection_log(ChimeConnection *cxn, ChimeLogLevel level, const gchar *format, ...)
+void chime_connection_set_log_level(ChimeConnection *self, ChimeLogLevel level)
+{
+	g_return_if_fail(CHIME_IS_CONNECTION(self));
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	priv->log_level = level;
+}
+
+gboolean chime_connection_log_enabled(ChimeConnection *cxn, ChimeLogLevel level)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	return level >= priv->log_level || priv->log_ring != NULL;
+}
+
+void chime_connection_do_log(ChimeConnection *cxn, ChimeLogLevel level, const gchar *format, ...)
 {
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
 	va_list args;
 	gchar *str;
 
 	va_start(args, format);
 	str = g_strdup_vprintf(format, args);
 	va_end(args);
-	g_signal_emit(cxn, signals[LOG_MESSAGE], 0, level, str);
+
+	chime_log_ring_add(priv->log_ring, str);
+	if (level >= priv->log_level)
+		g_signal_emit(cxn, signals[LOG_MESSAGE], 0, level, str);
 	g_free(str);
 }
 
+/* Whatever the log level was, show what led up to a failure */
+static void emit_log_lines(ChimeConnection *cxn, const gchar *title, gchar **lines)
+{
+	int i;
+
+	if (!lines)
+		return;
+
+	g_signal_emit(cxn, signals[LOG_MESSAGE], 0, CHIME_LOGLVL_WARNING, title);
+	for (i = 0; lines[i]; i++)
+		g_signal_emit(cxn, signals[LOG_MESSAGE], 0, CHIME_LOGLVL_WARNING, lines[i]);
+	g_strfreev(lines);
+}
+
+static void dump_log_ring(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	emit_log_lines(cxn, "Recent log messages before failure:\n",
+		       chime_log_ring_take(priv->log_ring));
+	emit_log_lines(cxn, "Recent trace points before failure:\n",
+		       chime_trace_ring_copy());
+}
+
 void chime_connection_progress(ChimeConnection *cxn, int percent, const gchar *message)
 {
 	g_signal_emit(cxn, signals[PROGRESS], 0, percent, message);
@@ -1157,6 +1860,20 @@ static void free_fetch_msg_data(gpointer _fmd)
 
 static void fetch_messages_req(ChimeConnection *self, GTask *task);
 
+static void fetch_messages_elem_cb(ChimeConnection *self, SoupMessage *msg,
+				   JsonNode *msg_node, gpointer user_data)
+{
+	GTask *task = G_TASK(user_data);
+	struct fetch_msg_data *fmd = g_task_get_task_data(task);
+	const gchar *id;
+
+	if (parse_string(msg_node, "MessageId", &id)) {
+		if (CHIME_IS_ROOM(fmd->obj))
+			chime_room_note_message(CHIME_ROOM(fmd->obj), msg_node);
+		g_signal_emit_by_name(fmd->obj, "message", msg_node);
+	}
+}
+
 static void fetch_messages_cb(ChimeConnection *self, SoupMessage *msg,
 			      JsonNode *node, gpointer user_data)
 {
@@ -1174,18 +1891,7 @@ static void fetch_messages_cb(ChimeConnection *self, SoupMessage *msg,
 					_("Failed to fetch messages: %d %s"),
 					msg->status_code, reason);
 	} else {
-		JsonObject *obj = json_node_get_object(node);
-		JsonNode *msgs_node = json_object_get_member(obj, "Messages");
-		JsonArray *msgs_array = json_node_get_array(msgs_node);
-		guint i, len = json_array_get_length(msgs_array);
-
-		for (i = 0; i < len; i++) {
-			JsonNode *msg_node = json_array_get_element(msgs_array, i);
-			const gchar *id;
-			if (parse_string(msg_node, "MessageId", &id))
-				g_signal_emit_by_name(fmd->obj, "message", msg_node);
-		}
-
+		/* The messages themselves went to fetch_messages_elem_cb() */
 		const gchar *next_token;
 		if (parse_string(node, "NextToken", &next_token)) {
 			g_hash_table_insert(fmd->query, (void *)"next-token", g_strdup(next_token));
@@ -1207,7 +1913,9 @@ static void fetch_messages_req(ChimeConnection *self, GTask *task)
 					   CHIME_IS_ROOM(fmd->obj) ? "room" : "conversation",
 					   chime_object_get_id(fmd->obj));
 	soup_uri_set_query_from_form(uri, fmd->query);
-	chime_connection_queue_http_request(self, NULL, uri, "GET", fetch_messages_cb, task);
+	chime_connection_queue_http_stream(self, NULL, uri, "GET", CHIME_REQUEST_MESSAGES, 0,
+					   "Messages", fetch_messages_elem_cb,
+					   fetch_messages_cb, task);
 
 }
 
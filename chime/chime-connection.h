@@ -50,11 +50,25 @@ typedef enum {
 	CHIME_LOGLVL_FATAL
 } ChimeLogLevel;
 
+/* Scheduling classes for REST requests, highest priority first. */
+typedef enum {
+	CHIME_REQUEST_INTERACTIVE,	/* User-initiated sends and lookups */
+	CHIME_REQUEST_MESSAGES,		/* Message fetches for open chats */
+	CHIME_REQUEST_BACKGROUND,	/* Collection sync, presence etc. */
+	CHIME_REQUEST_NR_PRIOS
+} ChimeRequestPriority;
+
 typedef void (*ChimeSoupMessageCallback)(ChimeConnection *cxn,
 					 SoupMessage *msg,
 					 JsonNode *node,
 					 gpointer cb_data);
 
+/* Called for each element of a streamed array, as it arrives */
+typedef void (*ChimeSoupElementCallback)(ChimeConnection *cxn,
+					 SoupMessage *msg,
+					 JsonNode *node,
+					 gpointer cb_data);
+
 ChimeConnection *chime_connection_new                        (const gchar *email,
 							      const gchar *server,
 							      const gchar *device_token,
@@ -105,6 +119,14 @@ const gchar *chime_connection_get_email(ChimeConnection *self);
 void chime_connection_connect(ChimeConnection *cxn);
 void chime_connection_disconnect(ChimeConnection *cxn);
 
+guint chime_connection_get_queue_depth(ChimeConnection *self, ChimeRequestPriority prio);
+guint chime_connection_get_requests_in_flight(ChimeConnection *self);
+void chime_connection_set_log_level(ChimeConnection *self, ChimeLogLevel level);
+JsonNode *chime_connection_get_request_stats(ChimeConnection *self);
+void chime_connection_reset_request_stats(ChimeConnection *self);
+JsonNode *chime_connection_get_jugg_stats(ChimeConnection *self);
+void chime_connection_reset_jugg_stats(ChimeConnection *self);
+
 /* XXX: Expose something other than a JsonNode for messages? */
 gboolean parse_int(JsonNode *node, const gchar *member, gint64 *val);
 gboolean parse_string(JsonNode *parent, const gchar *name, const gchar **res);
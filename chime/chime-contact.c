@@ -519,6 +519,16 @@ static gboolean fetch_presences(gpointer _cxn)
 
 static void fetch_contacts(ChimeConnection *cxn, const gchar *next_token);
 
+static void contacts_elem_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
+			     gpointer _unused)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	/* Don't bother if contacts_cb() is going to refetch anyway */
+	if (priv->contacts_sync == CHIME_SYNC_FETCHING)
+		chime_connection_parse_contact(cxn, TRUE, node, NULL);
+}
+
 static void contacts_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
 			gpointer _unused)
 {
@@ -532,15 +542,7 @@ static void contacts_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
 	}
 
 	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) && node) {
-		JsonArray *arr = json_node_get_array(node);
-		guint i, len = json_array_get_length(arr);
-
-		for (i = 0; i < len; i++) {
-			chime_connection_parse_contact(cxn, TRUE,
-						       json_array_get_element(arr, i),
-						       NULL);
-		}
-
+		/* The contacts themselves went to contacts_elem_cb() */
 		const gchar *next_token = soup_message_headers_get_one(msg->response_headers, "aws-ucbuzz-nexttoken");;
 		if (next_token)
 			fetch_contacts(cxn, next_token);
@@ -589,8 +591,9 @@ static void fetch_contacts(ChimeConnection *cxn, const gchar *next_token)
 	if (next_token)
 		soup_uri_set_query_from_fields(uri, "next_token", next_token, NULL);
 
-	chime_connection_queue_http_request(cxn, NULL, uri, "GET", contacts_cb,
-					    NULL);
+	chime_connection_queue_http_stream(cxn, NULL, uri, "GET", CHIME_REQUEST_BACKGROUND,
+					   next_token ? 0 : CHIME_HTTP_CACHE,
+					   NULL, contacts_elem_cb, contacts_cb, NULL);
 }
 
 void chime_init_contacts(ChimeConnection *cxn)
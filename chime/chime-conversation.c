@@ -465,6 +465,16 @@ static ChimeConversation *chime_connection_parse_conversation(ChimeConnection *c
 
 static void fetch_conversations(ChimeConnection *cxn, const gchar *next_token);
 
+static void conversations_elem_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
+				  gpointer _unused)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	/* Don't bother if conversations_cb() is going to refetch anyway */
+	if (priv->conversations_sync == CHIME_SYNC_FETCHING)
+		chime_connection_parse_conversation(cxn, node, NULL);
+}
+
 static void conversations_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
 			gpointer _unused)
 {
@@ -478,21 +488,13 @@ static void conversations_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *n
 	}
 
 	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) && node) {
+		/* The conversations themselves went to conversations_elem_cb() */
 		JsonObject *obj = json_node_get_object(node);
-		JsonNode *conversations_node = json_object_get_member(obj, "Conversations");
-		if (!conversations_node) {
+		if (!json_object_has_member(obj, "Conversations")) {
 			chime_connection_fail(cxn, CHIME_ERROR_BAD_RESPONSE,
 					      _("Failed to find Conversations node in response"));
 			return;
 		}
-		JsonArray *arr = json_node_get_array(conversations_node);
-		guint i, len = json_array_get_length(arr);
-
-		for (i = 0; i < len; i++) {
-			chime_connection_parse_conversation(cxn,
-							    json_array_get_element(arr, i),
-							    NULL);
-		}
 
 		const gchar *next_token;
 		if (parse_string(node, "NextToken", &next_token))
@@ -542,11 +544,22 @@ static void fetch_conversations(ChimeConnection *cxn, const gchar *next_token)
 	soup_uri_set_query_from_fields(uri, "max-results", "50",
 				       next_token ? "next-token" : NULL, next_token,
 				       NULL);
-	chime_connection_queue_http_request(cxn, NULL, uri, "GET", conversations_cb,
-					    NULL);
+	chime_connection_queue_http_stream(cxn, NULL, uri, "GET", CHIME_REQUEST_BACKGROUND,
+					   next_token ? 0 : CHIME_HTTP_CACHE,
+					   "Conversations", conversations_elem_cb, conversations_cb, NULL);
 }
 
 
+/* Conversation messages all arrive on the device channel, so there's no
+ * telling which conversations were active while the Juggernaut connection
+ * was down. Revalidate the list instead; it's a conditional GET which costs
+ * a 304 if nothing changed, and any LastSent which did change prompts the
+ * consumer to fetch just the messages after the last one it saw. */
+void chime_resume_conversations(ChimeConnection *cxn)
+{
+	fetch_conversations(cxn, NULL);
+}
+
 struct deferred_conv_jugg {
 	JuggernautCallback cb;
 	JsonNode *node;
@@ -610,7 +623,8 @@ static gboolean conv_msg_jugg_cb(ChimeConnection *cxn, gpointer _unused, JsonNod
 		defer->cb = conv_msg_jugg_cb;
 
 		SoupURI *uri = soup_uri_new_printf(priv->messaging_url, "/conversations/%s", conv_id);
-		if (chime_connection_queue_http_request(cxn, NULL, uri, "GET", fetch_new_conv_cb, defer))
+		if (chime_connection_queue_http_request_full(cxn, NULL, uri, "GET", CHIME_REQUEST_MESSAGES,
+							     fetch_new_conv_cb, defer))
 			return TRUE;
 
 		json_node_unref(defer->node);
@@ -885,7 +899,8 @@ void chime_connection_find_conversation_async(ChimeConnection *cxn,
 	soup_uri_set_query_from_fields(uri, "profile-ids", query_str, NULL);
 	g_free(query_str);
 
-	chime_connection_queue_http_request(cxn, NULL, uri, "GET", conv_found_cb, task);
+	chime_connection_queue_http_request_full(cxn, NULL, uri, "GET", CHIME_REQUEST_INTERACTIVE,
+						 conv_found_cb, task);
 }
 
 ChimeConversation *chime_connection_find_conversation_finish(ChimeConnection *self,
@@ -0,0 +1,314 @@
+/*
+ * Pidgin/libpurple Chime client plugin
+ *
+ * Copyright © 2017 Amazon.com, Inc. or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * A minimal on-disk cache for conditional GETs of the big collections
+ * (contacts, rooms, etc.), which would otherwise be downloaded in full on
+ * every reconnect and every time the server pokes us to refetch them.
+ *
+ * For each URL we keep two files in the per-profile cache directory:
+ * $hash.hdr, a GKeyFile of the response headers (including the ETag and
+ * Last-Modified validators), and $hash.body. The body is written as it
+ * arrives and renamed into place only when the response completes, and
+ * the .hdr is removed first so a crash can never pair old validators
+ * with a different body.
+ *
+ * On a 304 we restore the stored headers, set the status back to 200 and
+ * let soup_msg_cb() carry on as if the full response had arrived.
+ *
+ * Later pages of a paginated collection are keyed by a next-token which is
+ * never asked for again, so callers only ask for CHIME_HTTP_CACHE on the
+ * first page. Files which haven't been used for CACHE_MAX_AGE are pruned
+ * when the cache directory is first opened; a replay touches both files to
+ * keep them.
+ */
+
+#include "chime-connection.h"
+#include "chime-connection-private.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HDR_GROUP "Headers"
+#define CACHE_MAX_AGE (30 * 24 * 60 * 60)
+
+/* These describe the transfer, not the content, or are none of our business */
+static const gchar *uncached_headers[] = {
+	"Connection", "Keep-Alive", "Transfer-Encoding", "Content-Length",
+	"Content-Encoding", "Date", "Set-Cookie", NULL
+};
+
+static void prune_cache(ChimeConnection *cxn, const gchar *dir)
+{
+	time_t cutoff = time(NULL) - CACHE_MAX_AGE;
+	const gchar *name;
+	GDir *d;
+	int pruned = 0;
+
+	d = g_dir_open(dir, 0, NULL);
+	if (!d)
+		return;
+
+	while ((name = g_dir_read_name(d))) {
+		gchar *path = g_build_filename(dir, name, NULL);
+		GStatBuf st;
+
+		if (!g_stat(path, &st) && S_ISREG(st.st_mode) &&
+		    st.st_mtime < cutoff && !g_unlink(path))
+			pruned++;
+		g_free(path);
+	}
+	g_dir_close(d);
+
+	if (pruned)
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Pruned %d stale files from %s\n", pruned, dir);
+}
+
+static const gchar *cache_dir(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	if (priv->cache_dir)
+		return priv->cache_dir;
+
+	if (getenv("CHIME_NO_HTTP_CACHE") || !priv->profile_id)
+		return NULL;
+
+	gchar *dir = g_build_filename(g_get_user_cache_dir(), "pidgin-chime",
+				      priv->profile_id, NULL);
+	if (g_mkdir_with_parents(dir, 0700)) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Failed to create cache directory %s: %s\n",
+				     dir, g_strerror(errno));
+		g_free(dir);
+		return NULL;
+	}
+
+	prune_cache(cxn, dir);
+
+	priv->cache_dir = dir;
+	return dir;
+}
+
+static gchar *cache_file(struct chime_msg *cmsg, const gchar *suffix)
+{
+	return g_strdup_printf("%s.%s", cmsg->cache_path, suffix);
+}
+
+void chime_http_cache_prepare(ChimeConnection *cxn, struct chime_msg *cmsg)
+{
+	const gchar *dir = cache_dir(cxn);
+	if (!dir)
+		return;
+
+	gchar *uri = soup_uri_to_string(soup_message_get_uri(cmsg->msg), FALSE);
+	gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, uri, -1);
+	cmsg->cache_path = g_build_filename(dir, hash, NULL);
+	g_free(hash);
+	g_free(uri);
+
+	GKeyFile *kf = g_key_file_new();
+	gchar *hdr_file = cache_file(cmsg, "hdr");
+	if (g_key_file_load_from_file(kf, hdr_file, G_KEY_FILE_NONE, NULL)) {
+		gchar *etag = g_key_file_get_string(kf, HDR_GROUP, "ETag", NULL);
+		gchar *lastmod = g_key_file_get_string(kf, HDR_GROUP, "Last-Modified", NULL);
+
+		if (etag)
+			soup_message_headers_replace(cmsg->msg->request_headers,
+						     "If-None-Match", etag);
+		if (lastmod)
+			soup_message_headers_replace(cmsg->msg->request_headers,
+						     "If-Modified-Since", lastmod);
+		g_free(etag);
+		g_free(lastmod);
+	}
+	g_free(hdr_file);
+	g_key_file_unref(kf);
+}
+
+static void abort_write(struct chime_msg *cmsg)
+{
+	if (cmsg->cache_out) {
+		fclose(cmsg->cache_out);
+		cmsg->cache_out = NULL;
+		g_unlink(cmsg->cache_tmp);
+		g_clear_pointer(&cmsg->cache_tmp, g_free);
+	}
+}
+
+void chime_http_cache_got_headers(ChimeConnection *cxn, struct chime_msg *cmsg)
+{
+	SoupMessage *msg = cmsg->msg;
+	const gchar *cc;
+
+	/* In case of a resubmission after renewing the auth token */
+	abort_write(cmsg);
+
+	if (!cmsg->cache_path || !SOUP_STATUS_IS_SUCCESSFUL(msg->status_code))
+		return;
+
+	if (!soup_message_headers_get_one(msg->response_headers, "ETag") &&
+	    !soup_message_headers_get_one(msg->response_headers, "Last-Modified"))
+		return;
+
+	cc = soup_message_headers_get_list(msg->response_headers, "Cache-Control");
+	if (cc && soup_header_contains(cc, "no-store"))
+		return;
+
+	cmsg->cache_tmp = cache_file(cmsg, "XXXXXX");
+	int fd = g_mkstemp_full(cmsg->cache_tmp, O_WRONLY, 0600);
+	if (fd < 0 || !(cmsg->cache_out = fdopen(fd, "wb"))) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Failed to create cache file %s: %s\n",
+				     cmsg->cache_tmp, g_strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			g_unlink(cmsg->cache_tmp);
+		}
+		g_clear_pointer(&cmsg->cache_tmp, g_free);
+	}
+}
+
+void chime_http_cache_got_chunk(ChimeConnection *cxn, struct chime_msg *cmsg,
+				SoupBuffer *chunk)
+{
+	if (cmsg->cache_out &&
+	    fwrite(chunk->data, chunk->length, 1, cmsg->cache_out) != 1) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Failed to write cache file %s: %s\n",
+				     cmsg->cache_tmp, g_strerror(errno));
+		abort_write(cmsg);
+	}
+}
+
+static void save_header(const char *name, const char *value, gpointer _kf)
+{
+	GKeyFile *kf = _kf;
+	int i;
+
+	for (i = 0; uncached_headers[i]; i++) {
+		if (!g_ascii_strcasecmp(name, uncached_headers[i]))
+			return;
+	}
+	g_key_file_set_string(kf, HDR_GROUP, name, value);
+}
+
+/* Called with the completed message; commits or discards the body written so far */
+void chime_http_cache_complete(ChimeConnection *cxn, struct chime_msg *cmsg)
+{
+	SoupMessage *msg = cmsg->msg;
+
+	if (!cmsg->cache_out)
+		return;
+
+	if (!SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) || fclose(cmsg->cache_out)) {
+		abort_write(cmsg);
+		return;
+	}
+	cmsg->cache_out = NULL;
+
+	gchar *hdr_file = cache_file(cmsg, "hdr");
+	gchar *body_file = cache_file(cmsg, "body");
+	GKeyFile *kf = g_key_file_new();
+	GError *error = NULL;
+
+	soup_message_headers_foreach(msg->response_headers, save_header, kf);
+
+	g_unlink(hdr_file);
+	if (g_rename(cmsg->cache_tmp, body_file)) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Failed to rename cache file %s: %s\n",
+				     cmsg->cache_tmp, g_strerror(errno));
+		g_unlink(cmsg->cache_tmp);
+	} else if (!g_key_file_save_to_file(kf, hdr_file, &error)) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Failed to save cache file %s: %s\n",
+				     hdr_file, error->message);
+		g_clear_error(&error);
+	}
+
+	g_clear_pointer(&cmsg->cache_tmp, g_free);
+	g_key_file_unref(kf);
+	g_free(body_file);
+	g_free(hdr_file);
+}
+
+/* On a 304, restore the headers we stored and set the status back to 200.
+ * Returns the cached body, or NULL if the cache entry is unusable, in which
+ * case the request needs to be resubmitted unconditionally. */
+GMappedFile *chime_http_cache_replay(ChimeConnection *cxn, struct chime_msg *cmsg)
+{
+	SoupMessage *msg = cmsg->msg;
+	gchar *hdr_file = cache_file(cmsg, "hdr");
+	gchar *body_file = cache_file(cmsg, "body");
+	GKeyFile *kf = g_key_file_new();
+	GMappedFile *body = NULL;
+	GError *error = NULL;
+
+	if (!g_key_file_load_from_file(kf, hdr_file, G_KEY_FILE_NONE, &error) ||
+	    !(body = g_mapped_file_new(body_file, FALSE, &error))) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Failed to load cached response %s: %s\n",
+				     cmsg->cache_path, error->message);
+		g_clear_error(&error);
+		g_unlink(hdr_file);
+		g_unlink(body_file);
+	} else {
+		gchar **keys = g_key_file_get_keys(kf, HDR_GROUP, NULL, NULL);
+		int i;
+
+		for (i = 0; keys && keys[i]; i++) {
+			gchar *val = g_key_file_get_string(kf, HDR_GROUP, keys[i], NULL);
+			if (val)
+				soup_message_headers_replace(msg->response_headers, keys[i], val);
+			g_free(val);
+		}
+		g_strfreev(keys);
+
+		/* Still in use, so not for prune_cache() */
+		g_utime(hdr_file, NULL);
+		g_utime(body_file, NULL);
+
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC, "Using cached response for %s\n",
+				     soup_uri_get_path(soup_message_get_uri(msg)));
+	}
+
+	g_key_file_unref(kf);
+	g_free(body_file);
+	g_free(hdr_file);
+	return body;
+}
+
+/* Drop the conditional headers, for resubmission after a failed replay */
+void chime_http_cache_forget(struct chime_msg *cmsg)
+{
+	soup_message_headers_remove(cmsg->msg->request_headers, "If-None-Match");
+	soup_message_headers_remove(cmsg->msg->request_headers, "If-Modified-Since");
+	g_clear_pointer(&cmsg->cache_path, g_free);
+}
+
+void chime_http_cache_free(struct chime_msg *cmsg)
+{
+	abort_write(cmsg);
+	g_clear_pointer(&cmsg->cache_path, g_free);
+}
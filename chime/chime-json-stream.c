@@ -0,0 +1,249 @@
+/*
+ * Pidgin/libpurple Chime client plugin
+ *
+ * Copyright © 2017 Amazon.com, Inc. or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Incremental splitter for the large paged responses from the server,
+ * which are all either a bare array or an object with one big array
+ * member ("Rooms", "Messages", etc.) alongside a NextToken.
+ *
+ * We don't attempt to be a full JSON parser. We just track enough of the
+ * lexical structure (strings and nesting depth) to find the boundaries of
+ * the elements of that one array, and hand each element to JsonParser as
+ * soon as it is complete. Everything else in the response is kept as a
+ * 'skeleton' document, with the array left empty, and parsed at the end.
+ */
+
+#include "chime-connection-private.h"
+
+#include <glib/gi18n.h>
+
+struct _ChimeJsonStream {
+	gchar *member;		/* NULL for a top-level array */
+	ChimeJsonElementFunc func;
+	gpointer user_data;
+	JsonParser *parser;
+
+	GString *skel;		/* Everything except the array elements */
+	GString *elem;		/* The element being collected */
+	GString *key;		/* Last string seen at depth 1 */
+
+	guint depth;
+	guint array_depth;	/* Depth inside the streamed array, while in it */
+	gboolean array_done;
+	gboolean in_elem;
+	gboolean in_string;
+	gboolean escaped;
+	gboolean in_key;
+	gboolean key_done;
+	gboolean want_array;
+
+	gint64 parse_time;	/* µs spent in JsonParser */
+};
+
+ChimeJsonStream *chime_json_stream_new(const gchar *member,
+				       ChimeJsonElementFunc func,
+				       gpointer user_data)
+{
+	ChimeJsonStream *js = g_new0(ChimeJsonStream, 1);
+
+	js->member = g_strdup(member);
+	js->func = func;
+	js->user_data = user_data;
+	js->parser = json_parser_new();
+	js->skel = g_string_new(NULL);
+	js->elem = g_string_new(NULL);
+	js->key = g_string_new(NULL);
+
+	return js;
+}
+
+void chime_json_stream_free(ChimeJsonStream *js)
+{
+	g_free(js->member);
+	g_object_unref(js->parser);
+	g_string_free(js->skel, TRUE);
+	g_string_free(js->elem, TRUE);
+	g_string_free(js->key, TRUE);
+	g_free(js);
+}
+
+static void emit_element(ChimeJsonStream *js)
+{
+	GError *error = NULL;
+	gint64 start = g_get_monotonic_time();
+	gboolean ok = json_parser_load_from_data(js->parser, js->elem->str, js->elem->len, &error);
+
+	js->parse_time += g_get_monotonic_time() - start;
+
+	if (!ok) {
+		g_warning("Error loading data: %s", error->message);
+		g_error_free(error);
+	} else {
+		js->func(json_parser_get_root(js->parser), js->user_data);
+	}
+	g_string_truncate(js->elem, 0);
+	js->in_elem = FALSE;
+}
+
+/* Characters within an element. Returns TRUE if @c ended it (a comma or
+ * the closing bracket at the array's own depth), in which case the
+ * caller still needs to process @c itself. */
+static gboolean elem_char(ChimeJsonStream *js, gchar c)
+{
+	if (js->in_string) {
+		if (js->escaped)
+			js->escaped = FALSE;
+		else if (c == '\\')
+			js->escaped = TRUE;
+		else if (c == '"')
+			js->in_string = FALSE;
+	} else if (js->depth == js->array_depth && (c == ',' || c == ']')) {
+		return TRUE;
+	} else if (c == '"') {
+		js->in_string = TRUE;
+	} else if (c == '{' || c == '[') {
+		js->depth++;
+	} else if (c == '}' || c == ']') {
+		js->depth--;
+	}
+
+	g_string_append_c(js->elem, c);
+	return FALSE;
+}
+
+static void skel_char(ChimeJsonStream *js, gchar c)
+{
+	g_string_append_c(js->skel, c);
+
+	if (js->in_string) {
+		if (js->escaped) {
+			js->escaped = FALSE;
+		} else if (c == '\\') {
+			js->escaped = TRUE;
+		} else if (c == '"') {
+			js->in_string = FALSE;
+			if (js->in_key) {
+				js->in_key = FALSE;
+				js->key_done = TRUE;
+			}
+			return;
+		}
+		if (js->in_key)
+			g_string_append_c(js->key, c);
+		return;
+	}
+
+	if (g_ascii_isspace(c))
+		return;
+
+	if (js->want_array) {
+		js->want_array = FALSE;
+		if (c == '[') {
+			js->array_depth = ++js->depth;
+			return;
+		}
+	}
+
+	switch (c) {
+	case '"':
+		js->in_string = TRUE;
+		if (js->member && js->depth == 1 && !js->array_done) {
+			js->in_key = TRUE;
+			g_string_truncate(js->key, 0);
+		}
+		break;
+
+	case ':':
+		if (js->key_done && !strcmp(js->key->str, js->member))
+			js->want_array = TRUE;
+		break;
+
+	case '[':
+		js->depth++;
+		if (!js->member && js->depth == 1 && !js->array_done)
+			js->array_depth = js->depth;
+		break;
+
+	case '{':
+		js->depth++;
+		break;
+
+	case '}':
+	case ']':
+		/* Unbalanced; leave it for JsonParser to complain about */
+		if (js->depth)
+			js->depth--;
+		break;
+	}
+	js->key_done = FALSE;
+}
+
+void chime_json_stream_feed(ChimeJsonStream *js, const gchar *data, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		gchar c = data[i];
+
+		if (js->in_elem && !elem_char(js, c))
+			continue;
+
+		if (js->in_elem)
+			emit_element(js);
+
+		if (!js->array_depth) {
+			skel_char(js, c);
+			continue;
+		}
+
+		/* Between elements of the streamed array */
+		if (c == ']') {
+			js->array_depth = 0;
+			js->array_done = TRUE;
+			js->depth--;
+			g_string_append_c(js->skel, c);
+		} else if (c != ',' && !g_ascii_isspace(c)) {
+			js->in_elem = TRUE;
+			elem_char(js, c);
+		}
+	}
+}
+
+/* Returns the remainder of the document with the streamed array left empty,
+ * or NULL if it couldn't be parsed. Any elements not yet delivered (which
+ * can only happen for a truncated response) are discarded. */
+JsonNode *chime_json_stream_finish(ChimeJsonStream *js, GError **error)
+{
+	if (js->in_elem || js->array_depth) {
+		g_set_error(error, CHIME_ERROR, CHIME_ERROR_BAD_RESPONSE,
+			    _("Truncated JSON response"));
+		return NULL;
+	}
+
+	gint64 start = g_get_monotonic_time();
+	gboolean ok = json_parser_load_from_data(js->parser, js->skel->str, js->skel->len, error);
+
+	js->parse_time += g_get_monotonic_time() - start;
+	if (!ok)
+		return NULL;
+
+	JsonNode *root = json_parser_get_root(js->parser);
+	return root ? json_node_ref(root) : NULL;
+}
+
+gint64 chime_json_stream_get_parse_time(ChimeJsonStream *js)
+{
+	return js->parse_time;
+}
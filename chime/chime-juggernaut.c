@@ -15,7 +15,12 @@
  * Lesser General Public License for more details.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <glib/gi18n.h>
 #include <glib/glist.h>
@@ -27,20 +32,186 @@
 
 static void connect_jugg(ChimeConnection *cxn);
 
+/*
+ * priv->subscriptions maps each channel name to a struct jugg_channel.
+ *
+ * Within a channel, the subscriptions are indexed by the GQuark of their
+ * klass (or 0 for those which want everything), so a message only visits
+ * the handlers which are interested in it. Each subscription knows its
+ * slot in that array, so it can be removed without searching, and the
+ * 'subs' set finds it by {cb, cb_data, klass} in the first place.
+ *
+ * Handlers are still called in the order they subscribed, as they were
+ * before the index. Each array is kept in that order, and the wildcard
+ * and klass arrays are merged by sequence number when dispatching.
+ *
+ * A handler may well unsubscribe itself, or others, while we're calling
+ * it. So while a channel is being dispatched, removal just marks the
+ * subscription dead, and the arrays are cleaned up afterwards.
+ */
 struct jugg_subscription {
 	JuggernautCallback cb;
 	gpointer cb_data;
-	gchar *klass;
+	GQuark klass;
+	guint idx;
+	guint seq;
+	gboolean dead;
+};
+
+struct jugg_channel {
+	gchar *name;
+	guint refcount;
+	guint next_seq;
+	guint dispatching;
+	gboolean dirty;
+	GHashTable *subs;
+	GHashTable *handlers;
 };
 
-static void free_jugg_subscription(gpointer user_data)
+static guint sub_hash(gconstpointer _sub)
+{
+	const struct jugg_subscription *sub = _sub;
+
+	return g_direct_hash(sub->cb) ^ g_direct_hash(sub->cb_data) ^ sub->klass;
+}
+
+static gboolean sub_equal(gconstpointer _a, gconstpointer _b)
+{
+	const struct jugg_subscription *a = _a;
+	const struct jugg_subscription *b = _b;
+
+	return a->cb == b->cb && a->cb_data == b->cb_data && a->klass == b->klass;
+}
+
+static struct jugg_channel *jugg_channel_new(const gchar *name)
+{
+	struct jugg_channel *ch = g_new0(struct jugg_channel, 1);
+
+	ch->name = g_strdup(name);
+	ch->refcount = 1;
+	ch->subs = g_hash_table_new(sub_hash, sub_equal);
+	ch->handlers = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+					     (GDestroyNotify)g_ptr_array_unref);
+	return ch;
+}
+
+/* The handler arrays own the subscriptions, dead or alive */
+static void free_handlers(gpointer _q, gpointer _arr, gpointer _unused)
+{
+	GPtrArray *arr = _arr;
+	guint i;
+
+	for (i = 0; i < arr->len; i++)
+		g_free(arr->pdata[i]);
+}
+
+static void jugg_channel_unref(struct jugg_channel *ch)
+{
+	if (--ch->refcount)
+		return;
+
+	g_hash_table_foreach(ch->handlers, free_handlers, NULL);
+	g_hash_table_destroy(ch->handlers);
+	g_hash_table_destroy(ch->subs);
+	g_free(ch->name);
+	g_free(ch);
+}
+
+/* There are only ever a handful of subscriptions per klass, so keeping
+ * the arrays in order costs next to nothing */
+static void renumber_handlers(GPtrArray *arr, guint from)
+{
+	for (; from < arr->len; from++)
+		((struct jugg_subscription *)arr->pdata[from])->idx = from;
+}
+
+static void remove_handler(struct jugg_channel *ch, struct jugg_subscription *sub)
 {
-	struct jugg_subscription *sub = user_data;
+	GPtrArray *arr = g_hash_table_lookup(ch->handlers, GUINT_TO_POINTER(sub->klass));
 
-	g_free(sub->klass);
+	g_ptr_array_remove_index(arr, sub->idx);
+	if (arr->len)
+		renumber_handlers(arr, sub->idx);
+	else
+		g_hash_table_remove(ch->handlers, GUINT_TO_POINTER(sub->klass));
 	g_free(sub);
 }
 
+static gboolean purge_dead(gpointer _q, gpointer _arr, gpointer _unused)
+{
+	GPtrArray *arr = _arr;
+	guint i, j = 0;
+
+	for (i = 0; i < arr->len; i++) {
+		struct jugg_subscription *sub = arr->pdata[i];
+
+		if (sub->dead) {
+			g_free(sub);
+		} else {
+			sub->idx = j;
+			arr->pdata[j++] = sub;
+		}
+	}
+	g_ptr_array_set_size(arr, j);
+	return !arr->len;
+}
+
+static void send_subscription_message(ChimeConnection *cxn, const gchar *type, const gchar *channel);
+
+/* Drop the channel once nothing is subscribed to it, unless it's in use */
+static void jugg_channel_check_unused(ChimeConnection *cxn, struct jugg_channel *ch)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	if (ch->dispatching)
+		return;
+
+	if (ch->dirty) {
+		g_hash_table_foreach_remove(ch->handlers, purge_dead, NULL);
+		ch->dirty = FALSE;
+	}
+
+	if (g_hash_table_size(ch->subs) || !priv->subscriptions ||
+	    g_hash_table_lookup(priv->subscriptions, ch->name) != ch)
+		return;
+
+	if (priv->ws_conn)
+		send_subscription_message(cxn, "unsubscribe", ch->name);
+	g_hash_table_remove(priv->subscriptions, ch->name);
+}
+
+/* Call the wildcard handlers and those for @klass (if it has a quark at
+ * all) in the order they subscribed */
+static gboolean dispatch_handlers(ChimeConnection *cxn, struct jugg_channel *ch,
+				  GQuark klass, JsonNode *data_node)
+{
+	GPtrArray *all = g_hash_table_lookup(ch->handlers, GUINT_TO_POINTER(0));
+	GPtrArray *some = klass ? g_hash_table_lookup(ch->handlers, GUINT_TO_POINTER(klass)) : NULL;
+	gboolean handled = FALSE;
+	guint i = 0, j = 0;
+
+	/* Handlers added during dispatch may grow the arrays; that's fine */
+	while (1) {
+		struct jugg_subscription *a = (all && i < all->len) ? all->pdata[i] : NULL;
+		struct jugg_subscription *b = (some && j < some->len) ? some->pdata[j] : NULL;
+		struct jugg_subscription *sub;
+
+		if (a && (!b || a->seq < b->seq)) {
+			sub = a;
+			i++;
+		} else if (b) {
+			sub = b;
+			j++;
+		} else {
+			break;
+		}
+
+		if (!sub->dead && sub->cb)
+			handled |= sub->cb(cxn, sub->cb_data, data_node);
+	}
+	return handled;
+}
+
 #define KEEPALIVE_INTERVAL 30
 
 static void on_websocket_closed(SoupWebsocketConnection *ws,
@@ -62,14 +233,200 @@ static void on_websocket_closed(SoupWebsocketConnection *ws,
 				      _("Failed to establish WebSocket connection"));
 }
 
-static void handle_callback(ChimeConnection *cxn, const gchar *msg)
+/*
+ * Most pushes are only of interest to a handler or two, and some aren't
+ * wanted at all. So before building a DOM for the message, pick out the
+ * top-level "channel" and the "klass" from its "data" object with a quick
+ * lexical scan, and see if anyone is going to look at it. If the scan
+ * can't cope (escaped strings, or something unexpected) we fall back to
+ * parsing the whole thing and letting JsonParser decide.
+ */
+static const gchar *skip_ws(const gchar *p, const gchar *end)
+{
+	while (p < end && g_ascii_isspace(*p))
+		p++;
+	return p;
+}
+
+/* Returns the position after the closing quote, or NULL. */
+static const gchar *scan_string(const gchar *p, const gchar *end,
+				const gchar **str, gsize *len, gboolean *escaped)
+{
+	const gchar *start;
+
+	if (p >= end || *p != '"')
+		return NULL;
+
+	start = ++p;
+	*escaped = FALSE;
+	while (p < end && *p != '"') {
+		if (*p == '\\') {
+			*escaped = TRUE;
+			p++;
+		}
+		p++;
+	}
+	if (p >= end)
+		return NULL;
+
+	*str = start;
+	*len = p - start;
+	return p + 1;
+}
+
+static const gchar *skip_value(const gchar *p, const gchar *end)
+{
+	const gchar *s;
+	gsize l;
+	gboolean esc;
+	int depth = 0;
+
+	while (p < end) {
+		switch (*p) {
+		case '"':
+			p = scan_string(p, end, &s, &l, &esc);
+			if (!p)
+				return NULL;
+			if (!depth)
+				return p;
+			continue;
+
+		case '{':
+		case '[':
+			depth++;
+			break;
+
+		case '}':
+		case ']':
+			if (!depth)
+				return p;
+			if (!--depth)
+				return p + 1;
+			break;
+
+		case ',':
+			if (!depth)
+				return p;
+			break;
+		}
+		p++;
+	}
+	return depth ? NULL : p;
+}
+
+/* Find the string member @want of the object at @p. If @inner is given,
+ * also descend into the object member of that name and find @inner_want. */
+static gboolean scan_object(const gchar *p, const gchar *end, const gchar *want,
+			    const gchar **val, gsize *val_len,
+			    const gchar *inner, const gchar *inner_want,
+			    const gchar **inner_val, gsize *inner_len)
+{
+	const gchar *key;
+	gsize key_len;
+	gboolean esc;
+
+	p = skip_ws(p, end);
+	if (p >= end || *p != '{')
+		return FALSE;
+	p++;
+
+	while ((p = skip_ws(p, end)) < end && *p != '}') {
+		p = scan_string(p, end, &key, &key_len, &esc);
+		if (!p || esc)
+			return FALSE;
+		p = skip_ws(p, end);
+		if (p >= end || *p != ':')
+			return FALSE;
+		p = skip_ws(p + 1, end);
+
+		if (key_len == strlen(want) && !memcmp(key, want, key_len)) {
+			p = scan_string(p, end, val, val_len, &esc);
+			if (!p || esc)
+				return FALSE;
+		} else if (inner && key_len == strlen(inner) && !memcmp(key, inner, key_len)) {
+			const gchar *v_end = skip_value(p, end);
+
+			if (!v_end ||
+			    !scan_object(p, v_end, inner_want, inner_val, inner_len,
+					 NULL, NULL, NULL, NULL))
+				return FALSE;
+			p = v_end;
+		} else {
+			p = skip_value(p, end);
+			if (!p)
+				return FALSE;
+		}
+
+		p = skip_ws(p, end);
+		if (p < end && *p == ',')
+			p++;
+	}
+	return p < end;
+}
+
+static gboolean prescan_jugg_msg(const gchar *msg, gsize len,
+				 gchar **channel, gchar **klass)
+{
+	const gchar *c = NULL, *k = NULL;
+	gsize c_len = 0, k_len = 0;
+
+	if (!scan_object(msg, msg + len, "channel", &c, &c_len,
+			 "data", "klass", &k, &k_len) || !c || !k)
+		return FALSE;
+
+	*channel = g_strndup(c, c_len);
+	*klass = g_strndup(k, k_len);
+	return TRUE;
+}
+
+static gboolean channel_wants(struct jugg_channel *ch, GQuark klass)
+{
+	GPtrArray *arr = g_hash_table_lookup(ch->handlers, GUINT_TO_POINTER(klass));
+	guint i;
+
+	for (i = 0; arr && i < arr->len; i++) {
+		struct jugg_subscription *sub = arr->pdata[i];
+
+		if (!sub->dead && sub->cb)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void log_unhandled(ChimeConnection *cxn, const gchar *channel,
+			  const gchar *klass, gsize len)
+{
+	chime_connection_log(cxn, CHIME_LOGLVL_INFO,
+			     "Unhandled jugg msg on channel '%s' (klass '%s', %" G_GSIZE_FORMAT " bytes)\n",
+			     channel ? channel : "", klass ? klass : "", len);
+}
+
+static void handle_callback(ChimeConnection *cxn, const gchar *msg, gsize len)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	gchar *pre_channel, *pre_klass;
+
+	if (prescan_jugg_msg(msg, len, &pre_channel, &pre_klass)) {
+		struct jugg_channel *ch = g_hash_table_lookup(priv->subscriptions, pre_channel);
+		GQuark q = g_quark_try_string(pre_klass);
+		gboolean wanted = ch && (channel_wants(ch, 0) || (q && channel_wants(ch, q)));
+
+		if (!wanted) {
+			log_unhandled(cxn, pre_channel, pre_klass, len);
+			chime_stats_record_jugg(cxn, pre_channel, pre_klass, len, FALSE, 0);
+		}
+		g_free(pre_channel);
+		g_free(pre_klass);
+		if (!wanted)
+			return;
+	}
+
+	guint64 cpu_start = chime_stats_cpu_ns();
 	JsonParser *parser = json_parser_new();
 	gboolean handled = FALSE;
 	GError *error = NULL;
 
-	if (!json_parser_load_from_data(parser, msg, strlen(msg), &error)) {
+	if (!json_parser_load_from_data(parser, msg, len, &error)) {
 		chime_connection_log(cxn, CHIME_LOGLVL_WARNING, "Error parsing juggernaut message: '%s'\n",
 				     error->message);
 		g_error_free(error);
@@ -77,40 +434,123 @@ static void handle_callback(ChimeConnection *cxn, const gchar *msg)
 		return;
 	}
 
-	const gchar *channel = NULL;
+	const gchar *channel = NULL, *klass = NULL;
 	JsonNode *r = json_parser_get_root(parser);
 	if (parse_string(r, "channel", &channel)) {
 		JsonObject *obj = json_node_get_object(r);
 		JsonNode *data_node = json_object_get_member(obj, "data");
 
-		const gchar *klass;
-		if (parse_string(data_node, "klass", &klass)) {
-			    GList *l = g_hash_table_lookup(priv->subscriptions, channel);
-			    while (l) {
-				    struct jugg_subscription *sub = l->data;
-				    if (sub->cb && (!sub->klass || !strcmp(sub->klass, klass)))
-					    handled |= sub->cb(cxn, sub->cb_data, data_node);
-				    l = l->next;
-			    }
+		struct jugg_channel *ch = g_hash_table_lookup(priv->subscriptions, channel);
+		if (ch && parse_string(data_node, "klass", &klass)) {
+			/* If nobody has subscribed to this klass, it has no quark */
+			GQuark q = g_quark_try_string(klass);
+
+			ch->refcount++;
+			ch->dispatching++;
+			handled = dispatch_handlers(cxn, ch, q, data_node);
+			ch->dispatching--;
+			jugg_channel_check_unused(cxn, ch);
+			jugg_channel_unref(ch);
 		}
 	}
-	if (!handled) {
-		JsonGenerator *gen = json_generator_new();
-		json_generator_set_root(gen, r);
-		json_generator_set_pretty(gen, TRUE);
-
-		gchar *data = json_generator_to_data(gen, NULL);
-		chime_connection_log(cxn, CHIME_LOGLVL_INFO, "Unhandled jugg msg on channel '%s': %s\n",
-				     channel, data);
-		g_free(data);
-		g_object_unref(gen);
-	}
+	if (!handled)
+		log_unhandled(cxn, channel, klass, len);
+	/* Including the parse, which is only done for the handlers' benefit */
+	chime_stats_record_jugg(cxn, channel, klass, len, handled,
+				chime_stats_cpu_ns() - cpu_start);
 	g_object_unref(parser);
 }
 
-static void jugg_send(ChimeConnection *cxn, const gchar *fmt, ...)
+/*
+ * Acks are batched up and sent once per main loop iteration, or after
+ * CHIME_JUGG_ACK_WINDOW milliseconds if that is set. socket.io 0.9 only
+ * decodes multi-packet payloads on its polling transports, so each ack is
+ * still a frame of its own, but they are queued together and our own
+ * WebSocket code writes them out at once. They are kept in jugg_acks as
+ * consecutive NUL-terminated packets.
+ */
+static void discard_jugg_acks(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	if (priv->jugg_ack_source) {
+		g_source_remove(priv->jugg_ack_source);
+		priv->jugg_ack_source = 0;
+	}
+	if (priv->jugg_acks)
+		g_string_truncate(priv->jugg_acks, 0);
+	priv->jugg_nr_acks = 0;
+}
+
+static void flush_jugg_acks(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	const gchar *str, *end;
+
+	if (!priv->jugg_nr_acks)
+		return;
+
+	if (priv->ws_conn &&
+	    soup_websocket_connection_get_state(priv->ws_conn) == SOUP_WEBSOCKET_STATE_OPEN) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC, "Send %u juggernaut acks\n",
+				     priv->jugg_nr_acks);
+
+		str = priv->jugg_acks->str;
+		end = str + priv->jugg_acks->len;
+		for (; str < end; str += strlen(str) + 1)
+			soup_websocket_connection_send_text(priv->ws_conn, str);
+	}
+	discard_jugg_acks(cxn);
+}
+
+static gboolean jugg_ack_timeout(gpointer _cxn)
+{
+	ChimeConnection *cxn = _cxn;
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	priv->jugg_ack_source = 0;
+	flush_jugg_acks(cxn);
+	return G_SOURCE_REMOVE;
+}
+
+static void queue_jugg_ack(ChimeConnection *cxn, const gchar *id, gsize id_len)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	if (!priv->jugg_acks)
+		priv->jugg_acks = g_string_sized_new(256);
+
+	g_string_append_len(priv->jugg_acks, "6:::", 4);
+	g_string_append_len(priv->jugg_acks, id, id_len);
+	g_string_append_c(priv->jugg_acks, 0);
+	priv->jugg_nr_acks++;
+
+	if (priv->jugg_ack_source)
+		return;
+
+	/* An idle at default priority still runs on the next iteration even
+	 * while the socket keeps us busy, unlike a normal idle. */
+	if (priv->jugg_ack_window)
+		priv->jugg_ack_source = g_timeout_add(priv->jugg_ack_window,
+						      jugg_ack_timeout, cxn);
+	else
+		priv->jugg_ack_source = g_idle_add_full(G_PRIORITY_DEFAULT, jugg_ack_timeout,
+							cxn, NULL);
+}
+
+static void jugg_send_str(ChimeConnection *cxn, const gchar *str)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	/* Keep the acks in order with everything else */
+	flush_jugg_acks(cxn);
+
+	chime_connection_log(cxn, CHIME_LOGLVL_MISC, "Send juggernaut msg: %s\n", str);
+	soup_websocket_connection_send_text(priv->ws_conn, str);
+}
+
+static void jugg_send(ChimeConnection *cxn, const gchar *fmt, ...)
+{
 	va_list args;
 	gchar *str;
 
@@ -118,8 +558,7 @@ static void jugg_send(ChimeConnection *cxn, const gchar *fmt, ...)
 	str = g_strdup_vprintf(fmt, args);
 	va_end(args);
 
-	chime_connection_log(cxn, CHIME_LOGLVL_MISC, "Send juggernaut msg: %s\n", str);
-	soup_websocket_connection_send_text(priv->ws_conn, str);
+	jugg_send_str(cxn, str);
 	g_free(str);
 }
 
@@ -128,24 +567,194 @@ static void send_subscription_message(ChimeConnection *cxn, const gchar *type, c
 	jugg_send(cxn, "3:::{\"type\":\"%s\",\"channel\":\"%s\"}", type, channel);
 }
 
+/* A socket.io frame is "type:id:endpoint:data", where the data may itself
+ * contain colons. We find the parts in place rather than copying them. */
+struct jugg_frame {
+	const gchar *type, *id, *data;
+	gsize type_len, id_len, data_len;
+	gboolean has_endpoint;
+};
+
+static gboolean parse_jugg_frame(const gchar *buf, gsize len, struct jugg_frame *f)
+{
+	const gchar *end = buf + len;
+	const gchar *c1, *c2 = NULL, *c3 = NULL;
+
+	c1 = memchr(buf, ':', len);
+	if (!c1)
+		return FALSE;
+	c2 = memchr(c1 + 1, ':', end - (c1 + 1));
+	if (c2)
+		c3 = memchr(c2 + 1, ':', end - (c2 + 1));
+
+	f->type = buf;
+	f->type_len = c1 - buf;
+	f->id = c1 + 1;
+	f->id_len = (c2 ? c2 : end) - f->id;
+	f->has_endpoint = !!c2;
+	if (c3) {
+		f->data = c3 + 1;
+		f->data_len = end - f->data;
+	} else {
+		f->data = NULL;
+		f->data_len = 0;
+	}
+	return TRUE;
+}
+
+/*
+ * Anything pushed while we were reconnecting is gone, so once we're back
+ * ask for just what was missed. Allow a minute either side of the time we
+ * noticed the connection had died, for clock skew and for the keepalive
+ * timeout it may have taken to notice.
+ */
+#define JUGG_GAP_SLACK (60 * G_USEC_PER_SEC)
+
+static void jugg_resume(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	GDateTime *dt = g_date_time_new_from_unix_utc((priv->jugg_gap_start - JUGG_GAP_SLACK) /
+						      G_USEC_PER_SEC);
+	gchar *since = g_date_time_format(dt, "%Y-%m-%dT%H:%M:%S.000Z");
+
+	chime_connection_log(cxn, CHIME_LOGLVL_INFO,
+			     "Juggernaut reconnected; catching up since %s\n", since);
+	priv->jugg_gap_start = 0;
+
+	chime_resume_rooms(cxn, since);
+	chime_resume_conversations(cxn);
+
+	g_free(since);
+	g_date_time_unref(dt);
+}
+
+#define FRAME_IS(buf, len, str) ((len) == strlen(str) && !memcmp((buf), (str), (len)))
+
+/*
+ * Set CHIME_JUGG_CAPTURE to a filename to record every incoming frame, for
+ * feeding back through chime-replay later. The file starts with a header:
+ *
+ *   "CHJUGG01"
+ *   profile, presence and device channel names, each as a 16-bit length
+ *   followed by that many bytes
+ *
+ * and then for each frame a 64-bit monotonic timestamp in µs, a 32-bit
+ * length and the frame itself. All integers are little-endian.
+ *
+ * If a write fails, capturing stops there rather than carry on after a
+ * gap which chime-replay would misparse; it reports the file as truncated.
+ */
+#define JUGG_CAPTURE_MAGIC "CHJUGG01"
+
+static gboolean capture_write(FILE *f, gconstpointer data, gsize len)
+{
+	return !len || fwrite(data, 1, len, f) == len;
+}
+
+static gboolean capture_str(FILE *f, const gchar *str)
+{
+	guint16 len = str ? MIN(strlen(str), G_MAXUINT16) : 0;
+	guint16 len_le = GUINT16_TO_LE(len);
+
+	return capture_write(f, &len_le, sizeof(len_le)) &&
+		capture_write(f, str, len);
+}
+
+/* The buffered frames can fail to be written out by fclose() too */
+static void stop_jugg_capture(ChimeConnection *cxn, gboolean failed)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	int err = failed ? errno : 0;
+
+	if (fclose(priv->jugg_capture) && !err)
+		err = errno;
+	priv->jugg_capture = NULL;
+
+	if (err)
+		chime_connection_log(cxn, CHIME_LOGLVL_WARNING,
+				     "Failed to write Juggernaut capture file: %s\n",
+				     g_strerror(err));
+}
+
+static void open_jugg_capture(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	const gchar *path = getenv("CHIME_JUGG_CAPTURE");
+
+	if (!path || !*path || priv->jugg_capture)
+		return;
+
+	/* It holds the content of every message, so keep it to ourselves,
+	 * even if it already existed with a laxer mode */
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd >= 0) {
+		if (!fchmod(fd, 0600))
+			priv->jugg_capture = fdopen(fd, "wb");
+		if (!priv->jugg_capture)
+			close(fd);
+	}
+	if (!priv->jugg_capture) {
+		chime_connection_log(cxn, CHIME_LOGLVL_WARNING,
+				     "Failed to open Juggernaut capture file '%s': %s\n",
+				     path, g_strerror(errno));
+		return;
+	}
+
+	if (!capture_write(priv->jugg_capture, JUGG_CAPTURE_MAGIC, strlen(JUGG_CAPTURE_MAGIC)) ||
+	    !capture_str(priv->jugg_capture, priv->profile_channel) ||
+	    !capture_str(priv->jugg_capture, priv->presence_channel) ||
+	    !capture_str(priv->jugg_capture, priv->device_channel))
+		stop_jugg_capture(cxn, TRUE);
+}
+
+static void capture_frame(ChimeConnection *cxn, const gchar *data, gsize len)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	gint64 ts = GINT64_TO_LE(g_get_monotonic_time());
+	guint32 len_le = GUINT32_TO_LE(len);
+
+	if (!capture_write(priv->jugg_capture, &ts, sizeof(ts)) ||
+	    !capture_write(priv->jugg_capture, &len_le, sizeof(len_le)) ||
+	    !capture_write(priv->jugg_capture, data, len))
+		stop_jugg_capture(cxn, TRUE);
+}
+
+static void handle_jugg_frame(ChimeConnection *cxn, const gchar *data, gsize len);
+
 static void on_websocket_message(SoupWebsocketConnection *ws, gint type,
 				 GBytes *message, gpointer _cxn)
 {
 	ChimeConnection *cxn = _cxn;
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
-	gchar **parms;
-	gconstpointer data;
+	const gchar *data;
+	gsize len;
 
 	if (type != SOUP_WEBSOCKET_DATA_TEXT)
 		return;
 
-	data = g_bytes_get_data(message, NULL);
+	data = g_bytes_get_data(message, &len);
+	if (priv->jugg_capture)
+		capture_frame(cxn, data, len);
+
+	handle_jugg_frame(cxn, data, len);
+}
+
+/* For chime-replay, to push recorded frames through the normal path */
+void chime_jugg_replay_frame(ChimeConnection *cxn, const gchar *data, gsize len)
+{
+	handle_jugg_frame(cxn, data, len);
+}
+
+static void handle_jugg_frame(ChimeConnection *cxn, const gchar *data, gsize len)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	struct jugg_frame f;
 
 	chime_connection_log(cxn, CHIME_LOGLVL_MISC,
-			     "websocket message received:\n'%s'\n", (char *)data);
+			     "websocket message received:\n'%.*s'\n", (int)len, data);
 
 	/* DISCONNECT */
-	if (!strcmp(data, "0::")) {
+	if (FRAME_IS(data, len, "0::")) {
 		/* Do not attempt to reconnect */
 		priv->jugg_online = FALSE;
 		chime_connection_fail(cxn, CHIME_ERROR_NETWORK,
@@ -153,28 +762,28 @@ static void on_websocket_message(SoupWebsocketConnection *ws, gint type,
 		return;
 	}
 	/* CONNECT */
-	if (!strcmp(data, "1::")) {
+	if (FRAME_IS(data, len, "1::")) {
 		if (!priv->jugg_online) {
 			priv->jugg_online = TRUE;
 			chime_connection_calculate_online(cxn);
 		}
 		priv->jugg_connected = TRUE;
+		if (priv->jugg_gap_start)
+			jugg_resume(cxn);
 		return;
 	}
 	/* Keepalive */
-	if (!strcmp(data, "2::")) {
-		jugg_send(cxn, "2::");
+	if (FRAME_IS(data, len, "2::")) {
+		jugg_send_str(cxn, "2::");
 		return;
 	}
-	parms = g_strsplit(data, ":", 4);
-	if (parms[0] && parms[1] && *parms[1] && parms[2]) {
-		/* Send an ack */
-		jugg_send(cxn, "6:::%s", parms[1]);
+	if (parse_jugg_frame(data, len, &f) && f.id_len && f.has_endpoint) {
+		/* Ack it. The IDs are just sequence numbers. */
+		queue_jugg_ack(cxn, f.id, f.id_len);
 
-		if (priv->subscriptions && !strcmp(parms[0], "3") && parms[3])
-			handle_callback(cxn, parms[3]);
+		if (priv->subscriptions && FRAME_IS(f.type, f.type_len, "3") && f.data)
+			handle_callback(cxn, f.data, f.data_len);
 	}
-	g_strfreev(parms);
 }
 
 static gboolean pong_timeout(gpointer _cxn)
@@ -301,21 +910,33 @@ static void ws_key_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node, gp
 	msg = soup_message_new_from_uri("GET", uri);
 	soup_uri_free(uri);
 
+	/* Juggernaut pushes are JSON, which compresses well */
+	chime_websocket_offer_deflate(msg);
+
 	chime_connection_websocket_connect_async(cxn, msg, NULL, NULL, NULL,
 						 jugg_ws_connect_cb, cxn);
 }
 
 
 
+static void kill_sub(gpointer _sub, gpointer _unused, gpointer _unused2)
+{
+	struct jugg_subscription *sub = _sub;
+
+	sub->dead = TRUE;
+}
+
 static gboolean chime_sublist_destroy(gpointer k, gpointer v, gpointer _cxn)
 {
 	ChimeConnection *cxn = _cxn;
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	struct jugg_channel *ch = v;
 
 	if (priv->ws_conn)
 		send_subscription_message(_cxn, "unsubscribe", k);
 
-	g_list_free_full(v, free_jugg_subscription);
+	/* In case we're being called from one of its handlers */
+	g_hash_table_foreach(ch->subs, kill_sub, NULL);
 	return TRUE;
 }
 
@@ -356,6 +977,15 @@ void chime_destroy_juggernaut(ChimeConnection *cxn)
 		priv->keepalive_timer = 0;
 	}
 
+	priv->jugg_gap_start = 0;
+	if (priv->jugg_capture)
+		stop_jugg_capture(cxn, FALSE);
+	discard_jugg_acks(cxn);
+	if (priv->jugg_acks) {
+		g_string_free(priv->jugg_acks, TRUE);
+		priv->jugg_acks = NULL;
+	}
+
 	g_clear_pointer(&priv->ws_key, g_free);
 }
 
@@ -364,6 +994,9 @@ static void connect_jugg(ChimeConnection *cxn)
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
 	SoupURI *uri = soup_uri_new_printf(priv->websocket_url, "/1");
 
+	/* Note when we lost it, unless we were already reconnecting */
+	if (priv->jugg_connected && !priv->jugg_gap_start)
+		priv->jugg_gap_start = g_get_real_time();
 	priv->jugg_connected = FALSE;
 
 	if (priv->keepalive_timer) {
@@ -371,14 +1004,25 @@ static void connect_jugg(ChimeConnection *cxn)
 		priv->keepalive_timer = 0;
 	}
 
+	/* Those were for the old connection */
+	discard_jugg_acks(cxn);
 	g_clear_object(&priv->ws_conn);
 
 	soup_uri_set_query_from_fields(uri, "session_uuid", priv->session_id, NULL);
-	chime_connection_queue_http_request(cxn, NULL, uri, "GET", ws_key_cb, NULL);
+	chime_connection_queue_http_request_full(cxn, NULL, uri, "GET", CHIME_REQUEST_MESSAGES,
+						 ws_key_cb, NULL);
 }
 
 void chime_init_juggernaut(ChimeConnection *cxn)
 {
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	const gchar *window = getenv("CHIME_JUGG_ACK_WINDOW");
+
+	if (window && atoi(window) > 0)
+		priv->jugg_ack_window = atoi(window);
+
+	open_jugg_capture(cxn);
+
 	chime_connection_progress(cxn, 20, _("Obtaining WebSocket params..."));
 	connect_jugg(cxn);
 }
@@ -404,76 +1048,81 @@ gboolean chime_connection_jugg_send(ChimeConnection *cxn, JsonNode *node)
  * We allow multiple subscribers to a channel, as long as {cb, cb_data, klass}
  * is unique.
  *
- * priv->subscriptions is a GHashTable with 'channel' as key.
- *
- * Each value is a GList, containing the set of {cb,cb_data} subscribers.
- *
  * We send the server a subscribe request when the first subscription to a
  * channel occurs, and an unsubscribe request when the last one goes away.
  */
-static gboolean compare_sub(gconstpointer _a, gconstpointer _b)
-{
-	const struct jugg_subscription *a = _a;
-	const struct jugg_subscription *b = _b;
-
-	return !(a->cb == b->cb && a->cb_data == b->cb_data && !g_strcmp0(a->klass, b->klass));
-}
-
 void chime_jugg_subscribe(ChimeConnection *cxn, const gchar *channel, const gchar *klass,
 			  JuggernautCallback cb, gpointer cb_data)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
-	struct jugg_subscription *sub = g_new0(struct jugg_subscription, 1);
-	GList *l;
+	struct jugg_subscription *sub;
+	struct jugg_channel *ch;
+	GPtrArray *arr;
 
-	sub->cb = cb;
-	sub->cb_data = cb_data;
-	if (klass)
-		sub->klass = g_strdup(klass);
 	if (!priv->subscriptions)
-		priv->subscriptions = g_hash_table_new_full(g_str_hash, g_str_equal,
-							   g_free, NULL);
+		priv->subscriptions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+							   (GDestroyNotify)jugg_channel_unref);
+
+	ch = g_hash_table_lookup(priv->subscriptions, channel);
+	if (!ch) {
+		ch = jugg_channel_new(channel);
+		g_hash_table_insert(priv->subscriptions, ch->name, ch);
+		if (priv->ws_conn)
+			send_subscription_message(cxn, "subscribe", channel);
+	}
 
-	l = g_hash_table_lookup(priv->subscriptions, channel);
-	if (!l && priv->ws_conn)
-		send_subscription_message(cxn, "subscribe", channel);
+	sub = g_new0(struct jugg_subscription, 1);
+	sub->cb = cb;
+	sub->cb_data = cb_data;
+	sub->klass = klass ? g_quark_from_string(klass) : 0;
 
-	if (g_list_find_custom(l, sub, compare_sub)) {
-		free_jugg_subscription(sub);
+	if (g_hash_table_contains(ch->subs, sub)) {
+		g_free(sub);
 		return;
 	}
 
-	l = g_list_append(l, sub);
-	g_hash_table_replace(priv->subscriptions, g_strdup(channel), l);
+	arr = g_hash_table_lookup(ch->handlers, GUINT_TO_POINTER(sub->klass));
+	if (!arr) {
+		arr = g_ptr_array_new();
+		g_hash_table_insert(ch->handlers, GUINT_TO_POINTER(sub->klass), arr);
+	}
+	sub->idx = arr->len;
+	sub->seq = ch->next_seq++;
+	g_ptr_array_add(arr, sub);
+	g_hash_table_add(ch->subs, sub);
 }
 
 void chime_jugg_unsubscribe(ChimeConnection *cxn, const gchar *channel, const gchar *klass,
 			    JuggernautCallback cb, gpointer cb_data)
 {
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
-	struct jugg_subscription sub;
-	GList *l, *item;
+	struct jugg_subscription key, *sub;
+	struct jugg_channel *ch;
 
 	if (!priv->subscriptions)
 		return;
 
-	l = g_hash_table_lookup(priv->subscriptions, channel);
-	if (!l)
+	ch = g_hash_table_lookup(priv->subscriptions, channel);
+	if (!ch)
+		return;
+
+	/* Don't create a quark just to find out that it isn't there */
+	key.cb = cb;
+	key.cb_data = cb_data;
+	key.klass = klass ? g_quark_try_string(klass) : 0;
+	if (klass && !key.klass)
+		return;
+
+	sub = g_hash_table_lookup(ch->subs, &key);
+	if (!sub)
 		return;
 
-	sub.cb = cb;
-	sub.cb_data = cb_data;
-	sub.klass = (gchar *)klass;
-
-	item = g_list_find_custom(l, &sub, compare_sub);
-	if (item) {
-		free_jugg_subscription(item->data);
-		l = g_list_delete_link(l, item);
-		if (!l) {
-			g_hash_table_remove(priv->subscriptions, channel);
-			if (priv->ws_conn)
-				send_subscription_message(cxn, "unsubscribe", channel);
-		} else
-			g_hash_table_replace(priv->subscriptions, g_strdup(channel), l);
+	g_hash_table_remove(ch->subs, sub);
+	if (ch->dispatching) {
+		sub->dead = TRUE;
+		ch->dirty = TRUE;
+	} else {
+		remove_handler(ch, sub);
 	}
+	jugg_channel_check_unused(cxn, ch);
 }
@@ -0,0 +1,191 @@
+/*
+ * Pidgin/libpurple Chime client plugin
+ *
+ * Copyright © 2017 Amazon.com, Inc. or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Logging which costs next to nothing when it's turned off. The
+ * environment is read once, and everything checks the cached settings
+ * before doing any formatting.
+ *
+ * Set CHIME_LOG_RING to a number of lines to keep that many of the most
+ * recent log messages and trace points in memory, whatever the log level,
+ * so they can be dumped to the log if the connection fails. Each
+ * connection has a ring of its own, so one account failing doesn't take
+ * another's history with it; the trace points belong to no connection and
+ * go in a global one. The audio code can log from other threads, so each
+ * ring has a lock.
+ */
+
+#include "chime-log.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+struct _ChimeLogRing {
+	GMutex lock;
+	gchar **lines;
+	guint next, used;
+};
+
+static int debug_level = -1;
+static gboolean trace_print;
+static guint ring_size;
+static ChimeLogRing *trace_ring;
+
+static ChimeLogRing *ring_new(void)
+{
+	ChimeLogRing *ring = g_new0(ChimeLogRing, 1);
+
+	g_mutex_init(&ring->lock);
+	ring->lines = g_new0(gchar *, ring_size);
+	return ring;
+}
+
+static void log_init(void)
+{
+	static gsize done;
+
+	if (g_once_init_enter(&done)) {
+		const gchar *env = getenv("CHIME_DEBUG");
+
+		if (env)
+			debug_level = MAX(atoi(env), 0);
+
+		trace_print = !!getenv("CHIME_TRACE");
+
+		env = getenv("CHIME_LOG_RING");
+		if (env && atoi(env) > 0) {
+			ring_size = atoi(env);
+			trace_ring = ring_new();
+		}
+		g_once_init_leave(&done, 1);
+	}
+}
+
+int chime_debug_level(void)
+{
+	log_init();
+	return debug_level;
+}
+
+gboolean chime_log_ring_enabled(void)
+{
+	log_init();
+	return ring_size != 0;
+}
+
+/* Returns NULL if CHIME_LOG_RING isn't set; the other functions accept that */
+ChimeLogRing *chime_log_ring_new(void)
+{
+	return chime_log_ring_enabled() ? ring_new() : NULL;
+}
+
+void chime_log_ring_free(ChimeLogRing *ring)
+{
+	guint i;
+
+	if (!ring)
+		return;
+
+	for (i = 0; i < ring_size; i++)
+		g_free(ring->lines[i]);
+	g_free(ring->lines);
+	g_mutex_clear(&ring->lock);
+	g_free(ring);
+}
+
+void chime_log_ring_add(ChimeLogRing *ring, const gchar *str)
+{
+	gchar *copy;
+
+	if (!ring)
+		return;
+
+	copy = g_strdup(str);
+
+	g_mutex_lock(&ring->lock);
+	g_free(ring->lines[ring->next]);
+	ring->lines[ring->next] = copy;
+	ring->next = (ring->next + 1) % ring_size;
+	if (ring->used < ring_size)
+		ring->used++;
+	g_mutex_unlock(&ring->lock);
+}
+
+/* The ring's contents oldest first, or NULL. Emptied if @take is set. */
+static gchar **ring_lines(ChimeLogRing *ring, gboolean take)
+{
+	gchar **lines;
+	guint i, start;
+
+	if (!ring)
+		return NULL;
+
+	g_mutex_lock(&ring->lock);
+	if (!ring->used) {
+		g_mutex_unlock(&ring->lock);
+		return NULL;
+	}
+
+	lines = g_new0(gchar *, ring->used + 1);
+	start = (ring->next + ring_size - ring->used) % ring_size;
+	for (i = 0; i < ring->used; i++) {
+		guint slot = (start + i) % ring_size;
+
+		if (take) {
+			lines[i] = ring->lines[slot];
+			ring->lines[slot] = NULL;
+		} else {
+			lines[i] = g_strdup(ring->lines[slot]);
+		}
+	}
+	if (take)
+		ring->used = 0;
+	g_mutex_unlock(&ring->lock);
+
+	return lines;
+}
+
+gchar **chime_log_ring_take(ChimeLogRing *ring)
+{
+	return ring_lines(ring, TRUE);
+}
+
+/* The trace points are shared, so each failing connection just gets a copy */
+gchar **chime_trace_ring_copy(void)
+{
+	log_init();
+	return ring_lines(trace_ring, FALSE);
+}
+
+gboolean chime_trace_enabled(void)
+{
+	log_init();
+	return trace_print || ring_size;
+}
+
+void chime_trace(const gchar *format, ...)
+{
+	va_list args;
+	gchar *str;
+
+	va_start(args, format);
+	str = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	if (trace_print)
+		fputs(str, stderr);
+	chime_log_ring_add(trace_ring, str);
+	g_free(str);
+}
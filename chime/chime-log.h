@@ -0,0 +1,55 @@
+/*
+ * Pidgin/libpurple Chime client plugin
+ *
+ * Copyright © 2017 Amazon.com, Inc. or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __CHIME_LOG_H__
+#define __CHIME_LOG_H__
+
+#include <glib.h>
+#include <stdio.h>
+
+G_BEGIN_DECLS
+
+/* The value of CHIME_DEBUG, read once; -1 if it isn't set */
+int chime_debug_level(void);
+
+#define chime_debug(...) do { if (chime_debug_level() >= 0) printf(__VA_ARGS__); } while (0)
+
+/* Recent log messages kept in memory if CHIME_LOG_RING is set */
+typedef struct _ChimeLogRing ChimeLogRing;
+
+gboolean chime_log_ring_enabled(void);
+ChimeLogRing *chime_log_ring_new(void);
+void chime_log_ring_free(ChimeLogRing *ring);
+void chime_log_ring_add(ChimeLogRing *ring, const gchar *str);
+gchar **chime_log_ring_take(ChimeLogRing *ring);
+gchar **chime_trace_ring_copy(void);
+
+/*
+ * Trace points for the per-packet paths, which cost nothing at all unless
+ * built with --enable-trace. Even then they do no formatting unless
+ * CHIME_TRACE is set (to print them) or CHIME_LOG_RING is (to keep them).
+ */
+gboolean chime_trace_enabled(void);
+void chime_trace(const gchar *format, ...) G_GNUC_PRINTF(1, 2);
+
+#ifdef CHIME_ENABLE_TRACE
+#define CHIME_TRACE(...) do { if (G_UNLIKELY(chime_trace_enabled())) chime_trace(__VA_ARGS__); } while (0)
+#else
+#define CHIME_TRACE(...) do { } while (0)
+#endif
+
+G_END_DECLS
+
+#endif /* __CHIME_LOG_H__ */
@@ -79,6 +79,7 @@ struct _ChimeRoom {
 	ChimeConnection *cxn;
 	GHashTable *members;
 	gboolean members_done[2];
+	gchar *last_msg_time;	/* Newest CreatedOn seen, for catching up */
 };
 
 G_DEFINE_TYPE(ChimeRoom, chime_room, CHIME_TYPE_OBJECT)
@@ -116,6 +117,7 @@ chime_room_finalize(GObject *object)
 
 	if (self->members)
 		g_hash_table_destroy(self->members);
+	g_free(self->last_msg_time);
 
 	G_OBJECT_CLASS(chime_room_parent_class)->finalize(object);
 }
@@ -429,6 +431,17 @@ static ChimeRoom *chime_connection_parse_room(ChimeConnection *cxn, JsonNode *no
 }
 
 static void fetch_rooms(ChimeConnection *cxn, const gchar *next_token);
+static void resume_room(gpointer _id, gpointer _room, gpointer _gap_start);
+
+static void rooms_elem_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
+			  gpointer _unused)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	/* Don't bother if rooms_cb() is going to refetch anyway */
+	if (priv->rooms_sync == CHIME_SYNC_FETCHING)
+		chime_connection_parse_room(cxn, node, NULL);
+}
 
 static void rooms_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
 			gpointer _unused)
@@ -443,21 +456,13 @@ static void rooms_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
 	}
 
 	if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) && node) {
+		/* The rooms themselves went to rooms_elem_cb() */
 		JsonObject *obj = json_node_get_object(node);
-		JsonNode *rooms_node = json_object_get_member(obj, "Rooms");
-		if (!rooms_node) {
+		if (!json_object_has_member(obj, "Rooms")) {
 			chime_connection_fail(cxn, CHIME_ERROR_BAD_RESPONSE,
 					      _("Failed to find Rooms node in response"));
 			return;
 		}
-		JsonArray *arr = json_node_get_array(rooms_node);
-		guint i, len = json_array_get_length(arr);
-
-		for (i = 0; i < len; i++) {
-			chime_connection_parse_room(cxn,
-						    json_array_get_element(arr, i),
-						    NULL);
-		}
 
 		const gchar *next_token;
 		if (parse_string(node, "NextToken", &next_token))
@@ -467,6 +472,13 @@ static void rooms_cb(ChimeConnection *cxn, SoupMessage *msg, JsonNode *node,
 
 			chime_object_collection_expire_outdated(&priv->rooms);
 
+			if (priv->rooms_resume_since) {
+				if (priv->rooms.by_id)
+					g_hash_table_foreach(priv->rooms.by_id, resume_room,
+							     priv->rooms_resume_since);
+				g_clear_pointer(&priv->rooms_resume_since, g_free);
+			}
+
 			if (!priv->rooms_online) {
 				priv->rooms_online = TRUE;
 				chime_connection_calculate_online(cxn);
@@ -507,8 +519,9 @@ static void fetch_rooms(ChimeConnection *cxn, const gchar *next_token)
 	soup_uri_set_query_from_fields(uri, "max-results", "50",
 				       next_token ? "next-token" : NULL, next_token,
 				       NULL);
-	chime_connection_queue_http_request(cxn, NULL, uri, "GET", rooms_cb,
-					    NULL);
+	chime_connection_queue_http_stream(cxn, NULL, uri, "GET", CHIME_REQUEST_BACKGROUND,
+					   next_token ? 0 : CHIME_HTTP_CACHE,
+					   "Rooms", rooms_elem_cb, rooms_cb, NULL);
 }
 
 static gboolean visible_rooms_jugg_cb(ChimeConnection *cxn, gpointer _unused, JsonNode *data_node)
@@ -529,10 +542,74 @@ static gboolean room_msg_jugg_cb(ChimeConnection *cxn, gpointer _room, JsonNode
 	if (!parse_string(record, "MessageId", &id))
 		return FALSE;
 
+	chime_room_note_message(room, record);
 	g_signal_emit(room, signals[MESSAGE], 0, record);
 	return TRUE;
 }
 
+/* The timestamps are all in the same fixed ISO8601 form, so they sort as strings */
+void chime_room_note_message(ChimeRoom *room, JsonNode *record)
+{
+	const gchar *created;
+
+	if (parse_string(record, "CreatedOn", &created) &&
+	    g_strcmp0(created, room->last_msg_time) > 0) {
+		g_free(room->last_msg_time);
+		room->last_msg_time = g_strdup(created);
+	}
+}
+
+static void resume_fetch_done(GObject *source, GAsyncResult *result, gpointer _room)
+{
+	ChimeConnection *cxn = CHIME_CONNECTION(source);
+	ChimeRoom *room = _room;
+	GError *error = NULL;
+
+	if (!chime_connection_fetch_messages_finish(cxn, result, &error)) {
+		chime_connection_log(cxn, CHIME_LOGLVL_WARNING,
+				     "Failed to fetch missed messages for room %s: %s\n",
+				     chime_object_get_id(CHIME_OBJECT(room)), error->message);
+		g_error_free(error);
+	}
+	g_object_unref(room);
+}
+
+static void resume_room(gpointer _id, gpointer _room, gpointer _gap_start)
+{
+	ChimeRoom *room = _room;
+	const gchar *since = room->last_msg_time ? room->last_msg_time : _gap_start;
+
+	/* Closed rooms have no channel of their own; their mentions come
+	 * through the device channel and aren't worth a fetch each. */
+	if (!room->opens || !room->cxn)
+		return;
+
+	/* Nothing was said in it while we weren't looking */
+	if (g_strcmp0(room->last_sent, since) <= 0)
+		return;
+
+	chime_connection_log(room->cxn, CHIME_LOGLVL_MISC,
+			     "Fetching messages for room %s since %s\n",
+			     chime_object_get_id(CHIME_OBJECT(room)), since);
+	chime_connection_fetch_messages_async(room->cxn, CHIME_OBJECT(room), NULL, since,
+					      NULL, resume_fetch_done, g_object_ref(room));
+}
+
+/* After the Juggernaut connection has been down, revalidate the room list
+ * (a conditional GET, so a 304 if nothing changed) to learn each room's
+ * LastSent. Then fetch only what each open room with activity in the gap
+ * missed since the last message we saw in it. The consumer already
+ * discards messages it has seen, so any overlap is harmless. */
+void chime_resume_rooms(ChimeConnection *cxn, const gchar *gap_start)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	/* If we were already catching up from an earlier gap, keep that */
+	if (!priv->rooms_resume_since)
+		priv->rooms_resume_since = g_strdup(gap_start);
+	fetch_rooms(cxn, NULL);
+}
+
 static gboolean demux_room_msg_jugg_cb(ChimeConnection *cxn, gpointer _room, JsonNode *data_node);
 static void demux_fetch_room_done(GObject *source, GAsyncResult *result, gpointer user_data)
 {
@@ -637,6 +714,7 @@ void chime_destroy_rooms(ChimeConnection *cxn)
 		g_hash_table_foreach(priv->rooms.by_id, close_room, NULL);
 
 	chime_object_collection_destroy(&priv->rooms);
+	g_clear_pointer(&priv->rooms_resume_since, g_free);
 }
 
 ChimeRoom *chime_connection_room_by_name(ChimeConnection *cxn,
@@ -994,7 +1072,8 @@ void chime_connection_fetch_room_async(ChimeConnection *cxn, const gchar *room_i
 	GTask *task = g_task_new(cxn, cancellable, callback, user_data);
 
 	SoupURI *uri = soup_uri_new_printf(priv->messaging_url, "/rooms/%s", room_id);
-	chime_connection_queue_http_request(cxn, NULL, uri, "GET", fetch_new_room_cb, task);
+	chime_connection_queue_http_request_full(cxn, NULL, uri, "GET", CHIME_REQUEST_MESSAGES,
+						 fetch_new_room_cb, task);
 }
 
 ChimeRoom *chime_connection_fetch_room_finish(ChimeConnection *cxn, GAsyncResult *result, GError **error)
@@ -1027,7 +1027,7 @@ void chime_connection_signin(ChimeConnection *self)
 		return;
 	}
 
-	if (getenv("CHIME_DEBUG") && atoi(getenv("CHIME_DEBUG")) > 1) {
+	if (chime_debug_level() > 1) {
 		SoupLogger *l = soup_logger_new(SOUP_LOGGER_LOG_BODY, -1);
 		soup_session_add_feature(state->session, SOUP_SESSION_FEATURE(l));
 		g_object_unref(l);
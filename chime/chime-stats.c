@@ -0,0 +1,507 @@
+/*
+ * Pidgin/libpurple Chime client plugin
+ *
+ * Copyright © 2017 Amazon.com, Inc. or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Lightweight always-on statistics. Values go into power-of-two histograms,
+ * which cost a handful of instructions per sample and a fixed amount of
+ * memory, and are only turned into anything readable when asked for.
+ *
+ * REST requests are accounted per endpoint, where the endpoint is the
+ * method and path with anything which looks like an object ID replaced
+ * by {id}, e.g. "GET /rooms/{id}/memberships".
+ *
+ * Juggernaut pushes are accounted per channel and klass, so that a noisy
+ * room can be told apart from a storm of presence updates. Channels we
+ * haven't subscribed to, and klasses nobody has subscribed to, share one
+ * "(other)" entry each, so that a server sending arbitrary names can't make
+ * us keep every one of them.
+ */
+
+#include "chime-connection.h"
+#include "chime-connection-private.h"
+
+#include <string.h>
+#include <time.h>
+
+struct chime_endpoint_stats {
+	guint64 errors;
+	guint64 retries;
+	ChimeHistogram queue_wait;	/* µs from queueing to submission */
+	ChimeHistogram ttfb;		/* µs from submission to headers */
+	ChimeHistogram total;		/* µs from queueing to completion */
+	ChimeHistogram bytes;		/* Response body size */
+	ChimeHistogram parse;		/* µs spent parsing JSON */
+};
+
+struct chime_jugg_stats {
+	guint64 messages;
+	guint64 bytes;
+	guint64 unhandled;
+	guint64 cpu_ns;			/* Total in handlers */
+	ChimeHistogram handler;		/* ns in handlers, per message */
+};
+
+/* g_bit_nth_msf() only takes a gulong */
+static int log2_u64(guint64 val)
+{
+	if (val >> 32)
+		return 32 + g_bit_nth_msf((gulong)(val >> 32), -1);
+	return val ? g_bit_nth_msf((gulong)val, -1) : 0;
+}
+
+void chime_histogram_add(ChimeHistogram *h, guint64 val)
+{
+	int bucket = log2_u64(val);
+
+	if (!h->count || val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+	h->count++;
+	h->sum += val;
+	h->buckets[MIN(bucket, CHIME_HISTOGRAM_BUCKETS - 1)]++;
+}
+
+/* Upper bound of the bucket containing the given quantile, clamped to the
+ * actual maximum. Good enough to tell 10ms from 100ms from 1s. */
+guint64 chime_histogram_quantile(ChimeHistogram *h, double q)
+{
+	guint64 target, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (guint64)(q * h->count);
+	if (target >= h->count)
+		target = h->count - 1;
+
+	for (i = 0; i < CHIME_HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > target)
+			break;
+	}
+	if (i >= CHIME_HISTOGRAM_BUCKETS - 1)
+		return h->max;
+	return MIN(h->max, MAX(h->min, (G_GUINT64_CONSTANT(2) << i) - 1));
+}
+
+void chime_histogram_build_json(ChimeHistogram *h, JsonBuilder *jb)
+{
+	jb = json_builder_begin_object(jb);
+	jb = json_builder_set_member_name(jb, "count");
+	jb = json_builder_add_int_value(jb, h->count);
+	if (h->count) {
+		jb = json_builder_set_member_name(jb, "min");
+		jb = json_builder_add_int_value(jb, h->min);
+		jb = json_builder_set_member_name(jb, "max");
+		jb = json_builder_add_int_value(jb, h->max);
+		jb = json_builder_set_member_name(jb, "mean");
+		jb = json_builder_add_int_value(jb, h->sum / h->count);
+		jb = json_builder_set_member_name(jb, "p50");
+		jb = json_builder_add_int_value(jb, chime_histogram_quantile(h, 0.5));
+		jb = json_builder_set_member_name(jb, "p90");
+		jb = json_builder_add_int_value(jb, chime_histogram_quantile(h, 0.9));
+		jb = json_builder_set_member_name(jb, "p99");
+		jb = json_builder_add_int_value(jb, chime_histogram_quantile(h, 0.99));
+	}
+	jb = json_builder_end_object(jb);
+}
+
+/* Path segments which aren't plain lower-case words are IDs: UUIDs,
+ * numeric IDs, e-mail addresses and so on. */
+static gboolean is_id_segment(const gchar *seg, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		if (!g_ascii_islower(seg[i]) && seg[i] != '_' && seg[i] != '-')
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static gchar *endpoint_name(SoupMessage *msg)
+{
+	const gchar *path = soup_uri_get_path(soup_message_get_uri(msg));
+	GString *name = g_string_new(msg->method);
+
+	g_string_append_c(name, ' ');
+
+	while (*path) {
+		const gchar *end;
+
+		if (*path == '/') {
+			g_string_append_c(name, '/');
+			path++;
+			continue;
+		}
+		end = strchr(path, '/');
+		if (!end)
+			end = path + strlen(path);
+
+		if (is_id_segment(path, end - path))
+			g_string_append(name, "{id}");
+		else
+			g_string_append_len(name, path, end - path);
+		path = end;
+	}
+
+	return g_string_free(name, FALSE);
+}
+
+static gint64 elapsed(gint64 from, gint64 to)
+{
+	return (from && to > from) ? to - from : 0;
+}
+
+void chime_stats_record_request(ChimeConnection *cxn, struct chime_msg *cmsg)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	struct chime_endpoint_stats *st;
+	gchar *name = endpoint_name(cmsg->msg);
+	gint64 now = g_get_monotonic_time();
+
+	st = g_hash_table_lookup(priv->endpoint_stats, name);
+	if (!st) {
+		st = g_new0(struct chime_endpoint_stats, 1);
+		g_hash_table_insert(priv->endpoint_stats, name, st);
+	} else {
+		g_free(name);
+	}
+
+	if (!SOUP_STATUS_IS_SUCCESSFUL(cmsg->msg->status_code))
+		st->errors++;
+	st->retries += cmsg->retries;
+
+	chime_histogram_add(&st->queue_wait, elapsed(cmsg->queued_time, cmsg->submit_time));
+	if (cmsg->headers_time)
+		chime_histogram_add(&st->ttfb, elapsed(cmsg->submit_time, cmsg->headers_time));
+	chime_histogram_add(&st->total, elapsed(cmsg->queued_time, now));
+	chime_histogram_add(&st->bytes, cmsg->resp_bytes);
+	chime_histogram_add(&st->parse, cmsg->parse_time);
+}
+
+static void build_endpoint(gpointer _name, gpointer _st, gpointer _jb)
+{
+	const gchar *name = _name;
+	struct chime_endpoint_stats *st = _st;
+	JsonBuilder *jb = _jb;
+
+	jb = json_builder_set_member_name(jb, name);
+	jb = json_builder_begin_object(jb);
+	jb = json_builder_set_member_name(jb, "errors");
+	jb = json_builder_add_int_value(jb, st->errors);
+	jb = json_builder_set_member_name(jb, "retries");
+	jb = json_builder_add_int_value(jb, st->retries);
+	jb = json_builder_set_member_name(jb, "queue_wait_us");
+	chime_histogram_build_json(&st->queue_wait, jb);
+	jb = json_builder_set_member_name(jb, "ttfb_us");
+	chime_histogram_build_json(&st->ttfb, jb);
+	jb = json_builder_set_member_name(jb, "total_us");
+	chime_histogram_build_json(&st->total, jb);
+	jb = json_builder_set_member_name(jb, "bytes");
+	chime_histogram_build_json(&st->bytes, jb);
+	jb = json_builder_set_member_name(jb, "parse_us");
+	chime_histogram_build_json(&st->parse, jb);
+	jb = json_builder_end_object(jb);
+}
+
+/* Returns a new object with a member for each endpoint used so far, holding
+ * its error and retry counts and a summary (count, min, max, mean, p50, p90,
+ * p99) of each histogram. */
+JsonNode *chime_connection_get_request_stats(ChimeConnection *self)
+{
+	g_return_val_if_fail(CHIME_IS_CONNECTION(self), NULL);
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+	JsonBuilder *jb = json_builder_new();
+	JsonNode *node;
+
+	jb = json_builder_begin_object(jb);
+	g_hash_table_foreach(priv->endpoint_stats, build_endpoint, jb);
+	jb = json_builder_end_object(jb);
+
+	node = json_builder_get_root(jb);
+	g_object_unref(jb);
+	return node;
+}
+
+void chime_connection_reset_request_stats(ChimeConnection *self)
+{
+	g_return_if_fail(CHIME_IS_CONNECTION(self));
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	g_hash_table_remove_all(priv->endpoint_stats);
+}
+
+/* CPU time used by this thread. The handlers all run in the main loop, so
+ * the difference across a call to one is the time spent in it. */
+guint64 chime_stats_cpu_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+	return g_get_monotonic_time() * 1000;
+}
+
+void chime_stats_record_jugg(ChimeConnection *cxn, const gchar *channel, const gchar *klass,
+			     gsize bytes, gboolean handled, guint64 cpu_ns)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	/* 0 if nobody subscribed to it, which is the "(other)" bucket */
+	GQuark q = klass ? g_quark_try_string(klass) : 0;
+	struct chime_jugg_stats *st;
+	GHashTable *klasses;
+
+	if (!priv->jugg_stats)
+		return;
+
+	if (!channel || !priv->subscriptions ||
+	    !g_hash_table_contains(priv->subscriptions, channel))
+		channel = "(other)";
+
+	klasses = g_hash_table_lookup(priv->jugg_stats, channel);
+	if (!klasses) {
+		klasses = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+		g_hash_table_insert(priv->jugg_stats, g_strdup(channel), klasses);
+	}
+
+	st = g_hash_table_lookup(klasses, GUINT_TO_POINTER(q));
+	if (!st) {
+		st = g_new0(struct chime_jugg_stats, 1);
+		g_hash_table_insert(klasses, GUINT_TO_POINTER(q), st);
+	}
+
+	st->messages++;
+	st->bytes += bytes;
+	if (!handled)
+		st->unhandled++;
+	st->cpu_ns += cpu_ns;
+	chime_histogram_add(&st->handler, cpu_ns);
+}
+
+static const gchar *jugg_klass_name(gpointer _q)
+{
+	GQuark q = GPOINTER_TO_UINT(_q);
+
+	return q ? g_quark_to_string(q) : "(other)";
+}
+
+static void build_jugg_klass(gpointer _q, gpointer _st, gpointer _jb)
+{
+	struct chime_jugg_stats *st = _st;
+	JsonBuilder *jb = _jb;
+
+	jb = json_builder_set_member_name(jb, jugg_klass_name(_q));
+	jb = json_builder_begin_object(jb);
+	jb = json_builder_set_member_name(jb, "messages");
+	jb = json_builder_add_int_value(jb, st->messages);
+	jb = json_builder_set_member_name(jb, "bytes");
+	jb = json_builder_add_int_value(jb, st->bytes);
+	jb = json_builder_set_member_name(jb, "unhandled");
+	jb = json_builder_add_int_value(jb, st->unhandled);
+	jb = json_builder_set_member_name(jb, "cpu_us");
+	jb = json_builder_add_int_value(jb, st->cpu_ns / 1000);
+	jb = json_builder_set_member_name(jb, "handler_ns");
+	chime_histogram_build_json(&st->handler, jb);
+	jb = json_builder_end_object(jb);
+}
+
+static void build_jugg_channel(gpointer _name, gpointer _klasses, gpointer _jb)
+{
+	JsonBuilder *jb = _jb;
+
+	jb = json_builder_set_member_name(jb, _name);
+	jb = json_builder_begin_object(jb);
+	g_hash_table_foreach(_klasses, build_jugg_klass, jb);
+	jb = json_builder_end_object(jb);
+}
+
+/* Returns a new object with a member for each channel which has seen
+ * traffic, holding a member for each klass with its message, byte and
+ * unhandled counts, the total CPU time its handlers took and a summary of
+ * the time per message. */
+JsonNode *chime_connection_get_jugg_stats(ChimeConnection *self)
+{
+	g_return_val_if_fail(CHIME_IS_CONNECTION(self), NULL);
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+	JsonBuilder *jb = json_builder_new();
+	JsonNode *node;
+
+	jb = json_builder_begin_object(jb);
+	g_hash_table_foreach(priv->jugg_stats, build_jugg_channel, jb);
+	jb = json_builder_end_object(jb);
+
+	node = json_builder_get_root(jb);
+	g_object_unref(jb);
+	return node;
+}
+
+void chime_connection_reset_jugg_stats(ChimeConnection *self)
+{
+	g_return_if_fail(CHIME_IS_CONNECTION(self));
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (self);
+
+	g_hash_table_remove_all(priv->jugg_stats);
+}
+
+static void dump_endpoint(gpointer _name, gpointer _st, gpointer _cxn)
+{
+	const gchar *name = _name;
+	struct chime_endpoint_stats *st = _st;
+	ChimeConnection *cxn = _cxn;
+
+	chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+			     "%s: n %" G_GUINT64_FORMAT " err %" G_GUINT64_FORMAT
+			     " retry %" G_GUINT64_FORMAT " wait p50 %" G_GUINT64_FORMAT
+			     "us ttfb p50/p99 %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT
+			     "us total p50/p99 %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT
+			     "us bytes max %" G_GUINT64_FORMAT " parse max %" G_GUINT64_FORMAT "us\n",
+			     name, st->total.count, st->errors, st->retries,
+			     chime_histogram_quantile(&st->queue_wait, 0.5),
+			     chime_histogram_quantile(&st->ttfb, 0.5),
+			     chime_histogram_quantile(&st->ttfb, 0.99),
+			     chime_histogram_quantile(&st->total, 0.5),
+			     chime_histogram_quantile(&st->total, 0.99),
+			     st->bytes.max, st->parse.max);
+}
+
+/*
+ * For the periodic summary, channels are lumped together by their kind
+ * (the part before the '!'), since there's one presence channel for each
+ * contact and we want to know about them as a whole. The full breakdown
+ * is in chime_connection_get_jugg_stats().
+ */
+struct jugg_sum {
+	guint64 messages;
+	guint64 bytes;
+	guint64 unhandled;
+	guint64 cpu_ns;
+	guint64 max_ns;
+	guint channels;
+};
+
+static void sum_jugg_klass(gpointer _q, gpointer _st, gpointer _data)
+{
+	struct chime_jugg_stats *st = _st;
+	gpointer *data = _data;
+	GHashTable *sums = data[0];
+	gchar *key = g_strdup_printf("%s %s", (gchar *)data[1],
+				     jugg_klass_name(_q));
+	struct jugg_sum *sum = g_hash_table_lookup(sums, key);
+
+	if (!sum) {
+		sum = g_new0(struct jugg_sum, 1);
+		g_hash_table_insert(sums, key, sum);
+	} else {
+		g_free(key);
+	}
+
+	sum->messages += st->messages;
+	sum->bytes += st->bytes;
+	sum->unhandled += st->unhandled;
+	sum->cpu_ns += st->cpu_ns;
+	sum->max_ns = MAX(sum->max_ns, st->handler.max);
+	sum->channels++;
+}
+
+static void sum_jugg_channel(gpointer _name, gpointer _klasses, gpointer _sums)
+{
+	const gchar *name = _name;
+	const gchar *bang = strchr(name, '!');
+	gchar *kind = bang ? g_strndup(name, bang - name) : g_strdup(name);
+	gpointer data[2] = { _sums, kind };
+
+	g_hash_table_foreach(_klasses, sum_jugg_klass, data);
+	g_free(kind);
+}
+
+static void dump_jugg(gpointer _name, gpointer _sum, gpointer _cxn)
+{
+	const gchar *name = _name;
+	struct jugg_sum *sum = _sum;
+	ChimeConnection *cxn = _cxn;
+
+	chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+			     "%s: n %" G_GUINT64_FORMAT " channels %u unhandled %" G_GUINT64_FORMAT
+			     " bytes %" G_GUINT64_FORMAT " cpu %" G_GUINT64_FORMAT "us max %"
+			     G_GUINT64_FORMAT "us\n",
+			     name, sum->messages, sum->channels, sum->unhandled, sum->bytes,
+			     sum->cpu_ns / 1000, sum->max_ns / 1000);
+}
+
+static gboolean stats_dump_cb(gpointer _cxn)
+{
+	ChimeConnection *cxn = _cxn;
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	if (g_hash_table_size(priv->endpoint_stats)) {
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC, "REST request statistics:\n");
+		g_hash_table_foreach(priv->endpoint_stats, dump_endpoint, cxn);
+	}
+	if (g_hash_table_size(priv->jugg_stats)) {
+		GHashTable *sums = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+		g_hash_table_foreach(priv->jugg_stats, sum_jugg_channel, sums);
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC, "Juggernaut statistics:\n");
+		g_hash_table_foreach(sums, dump_jugg, cxn);
+		g_hash_table_destroy(sums);
+	}
+#ifndef USE_LIBSOUP_WEBSOCKETS
+	guint64 raw_out, wire_out, raw_in, wire_in;
+
+	if (priv->ws_conn &&
+	    chime_websocket_connection_get_deflate_stats(priv->ws_conn, &raw_out, &wire_out,
+							 &raw_in, &wire_in))
+		chime_connection_log(cxn, CHIME_LOGLVL_MISC,
+				     "Juggernaut compression: sent %" G_GUINT64_FORMAT " bytes as %"
+				     G_GUINT64_FORMAT " (%.1f%%), received %" G_GUINT64_FORMAT
+				     " bytes as %" G_GUINT64_FORMAT " (%.1f%%)\n",
+				     raw_out, wire_out, raw_out ? 100.0 * wire_out / raw_out : 100.0,
+				     raw_in, wire_in, raw_in ? 100.0 * wire_in / raw_in : 100.0);
+#endif
+	return G_SOURCE_CONTINUE;
+}
+
+/* Set CHIME_STATS_INTERVAL to a number of seconds to have the statistics
+ * dumped to the debug log that often. */
+void chime_init_stats(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+	const gchar *interval = getenv("CHIME_STATS_INTERVAL");
+
+	priv->endpoint_stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, g_free);
+	priv->jugg_stats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+						 (GDestroyNotify)g_hash_table_destroy);
+
+	if (interval && atoi(interval) > 0)
+		priv->stats_timer = g_timeout_add_seconds(atoi(interval), stats_dump_cb, cxn);
+}
+
+void chime_destroy_stats(ChimeConnection *cxn)
+{
+	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
+
+	if (priv->stats_timer) {
+		g_source_remove(priv->stats_timer);
+		priv->stats_timer = 0;
+	}
+	g_clear_pointer(&priv->endpoint_stats, g_hash_table_destroy);
+	g_clear_pointer(&priv->jugg_stats, g_hash_table_destroy);
+}
@@ -20,10 +20,14 @@
  * along with this library; If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 
 #include <libsoup/soup.h>
 #include "chime-websocket-connection.h"
+#include "chime-log.h"
+#include "chime-websocket-mask.h"
 
 /*
  * SECTION:websocketconnection
@@ -81,6 +85,9 @@ enum {
 	PROP_STATE,
 	PROP_MAX_INCOMING_PAYLOAD_SIZE,
 	PROP_KEEPALIVE_INTERVAL,
+	PROP_BUFFERED_AMOUNT,
+	PROP_HIGH_WATER_MARK,
+	PROP_LOW_WATER_MARK,
 };
 
 enum {
@@ -89,10 +96,21 @@ enum {
 	CLOSING,
 	CLOSED,
 	PONG,
+	STALLED,
+	WRITABLE,
 	NUM_SIGNALS
 };
 
 static guint signals[NUM_SIGNALS] = { 0, };
+static GParamSpec *buffered_amount_pspec;
+
+/* The input buffer. Messages which arrived in a single frame are handed
+ * out as slices of it, each holding a reference, so it can only be reused
+ * once all of those have been freed. */
+typedef struct {
+	gint refs;
+	GByteArray *array;
+} InputBuffer;
 
 typedef struct {
 	GBytes *data;
@@ -124,21 +142,56 @@ struct _ChimeWebsocketConnectionPrivate {
 
 	GPollableInputStream *input;
 	GSource *input_source;
-	GByteArray *incoming;
+	InputBuffer *incoming;
+	gsize incoming_start;	/* Already processed, at the front of incoming */
+	gsize read_size;
 
 	GPollableOutputStream *output;
+
+	/* Frames may be queued from any thread, so output_source, outgoing
+	 * and the buffered amount with its water marks are under this lock */
+	GMutex outgoing_lock;
 	GSource *output_source;
 	GQueue outgoing;
+	gsize buffered_amount;	/* Data message bytes queued and not yet sent */
+	guint64 high_water_mark;
+	guint64 low_water_mark;
+	gboolean stalled;
+	gboolean stalled_signalled;	/* Only touched in main_context */
 
 	/* Current message being assembled */
 	guint8 message_opcode;
+	gboolean message_compressed;
 	GByteArray *message_data;
 
+	/* permessage-deflate (RFC 7692), if negotiated */
+	z_stream *deflater;
+	z_stream *inflater;
+	gboolean deflate_reset;		/* client_no_context_takeover */
+	gboolean inflate_reset;		/* server_no_context_takeover */
+	guint64 raw_out, wire_out;	/* Data message payload bytes */
+	guint64 raw_in, wire_in;
+
 	GSource *keepalive_timeout;
 };
 
 #define MAX_INCOMING_PAYLOAD_SIZE_DEFAULT   128 * 1024
 
+#define HIGH_WATER_MARK_DEFAULT   (1024 * 1024)
+#define LOW_WATER_MARK_DEFAULT    (256 * 1024)
+
+/* Smaller messages aren't worth compressing */
+#define DEFLATE_MIN_SIZE 64
+
+/* Most queued frames written by a single writev() */
+#define MAX_WRITE_FRAMES 64
+
+/* Reads start small and double while each one fills the buffer, so a
+ * stream of screen-share data is read in big chunks but an idle socket
+ * doesn't pin a big buffer */
+#define READ_SIZE_MIN   4096
+#define READ_SIZE_MAX   (256 * 1024)
+
 G_DEFINE_TYPE_WITH_PRIVATE (ChimeWebsocketConnection, chime_websocket_connection, G_TYPE_OBJECT)
 
 typedef enum {
@@ -150,6 +203,96 @@ typedef enum {
 static void queue_frame (ChimeWebsocketConnection *self, ChimeWebsocketQueueFlags flags,
 			 gpointer data, gsize len, gsize amount);
 
+static InputBuffer *
+input_buffer_new (gsize size)
+{
+	InputBuffer *ib = g_slice_new (InputBuffer);
+
+	ib->refs = 1;
+	ib->array = g_byte_array_sized_new (size);
+	return ib;
+}
+
+static InputBuffer *
+input_buffer_ref (InputBuffer *ib)
+{
+	g_atomic_int_inc (&ib->refs);
+	return ib;
+}
+
+static void
+input_buffer_unref (gpointer data)
+{
+	InputBuffer *ib = data;
+
+	if (g_atomic_int_dec_and_test (&ib->refs)) {
+		g_byte_array_unref (ib->array);
+		g_slice_free (InputBuffer, ib);
+	}
+}
+
+/* Whether any messages still point into it; only we can add more */
+static gboolean
+input_buffer_lent (InputBuffer *ib)
+{
+	return g_atomic_int_get (&ib->refs) > 1;
+}
+
+/* Called with outgoing_lock held. Returns TRUE if the buffered amount
+ * has crossed one of the water marks. */
+static gboolean
+account_buffered_amount (ChimeWebsocketConnectionPrivate *pv,
+			 gsize added,
+			 gsize sent)
+{
+	pv->buffered_amount += added;
+	pv->buffered_amount -= sent;
+
+	if (!pv->stalled && pv->high_water_mark &&
+	    pv->buffered_amount > pv->high_water_mark) {
+		pv->stalled = TRUE;
+		return TRUE;
+	} else if (pv->stalled && pv->buffered_amount <= pv->low_water_mark) {
+		pv->stalled = FALSE;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Runs in main_context, so "stalled" and "writable" (and the notify of
+ * the buffered amount which goes with them) are emitted one at a time,
+ * and always end up agreeing with the current state however the senders
+ * on other threads raced to change it. */
+static gboolean
+emit_stalled_or_writable (gpointer user_data)
+{
+	ChimeWebsocketConnection *self = user_data;
+	ChimeWebsocketConnectionPrivate *pv = self->pv;
+	gboolean stalled;
+
+	g_mutex_lock (&pv->outgoing_lock);
+	stalled = pv->stalled;
+	g_mutex_unlock (&pv->outgoing_lock);
+
+	if (stalled != pv->stalled_signalled) {
+		pv->stalled_signalled = stalled;
+		g_debug (stalled ? "stalled" : "writable again");
+		g_object_notify_by_pspec (G_OBJECT (self), buffered_amount_pspec);
+		g_signal_emit (self, signals[stalled ? STALLED : WRITABLE], 0);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* Called without outgoing_lock, after account_buffered_amount() says
+ * a water mark was crossed */
+static void
+water_mark_crossed (ChimeWebsocketConnection *self)
+{
+	g_main_context_invoke_full (self->pv->main_context, G_PRIORITY_DEFAULT,
+				    emit_stalled_or_writable,
+				    g_object_ref (self), g_object_unref);
+}
+
 static void
 frame_free (gpointer data)
 {
@@ -168,7 +311,9 @@ chime_websocket_connection_init (ChimeWebsocketConnection *self)
 
 	pv = self->pv = chime_websocket_connection_get_instance_private (self);
 
-	pv->incoming = g_byte_array_sized_new (1024);
+	pv->incoming = input_buffer_new (READ_SIZE_MIN);
+	pv->read_size = READ_SIZE_MIN;
+	g_mutex_init (&pv->outgoing_lock);
 	g_queue_init (&pv->outgoing);
 	pv->main_context = g_main_context_ref_thread_default ();
 }
@@ -214,8 +359,9 @@ stop_input (ChimeWebsocketConnection *self)
 	}
 }
 
+/* Called with outgoing_lock held */
 static void
-stop_output (ChimeWebsocketConnection *self)
+stop_output_locked (ChimeWebsocketConnection *self)
 {
 	ChimeWebsocketConnectionPrivate *pv = self->pv;
 
@@ -227,6 +373,14 @@ stop_output (ChimeWebsocketConnection *self)
 	}
 }
 
+static void
+stop_output (ChimeWebsocketConnection *self)
+{
+	g_mutex_lock (&self->pv->outgoing_lock);
+	stop_output_locked (self);
+	g_mutex_unlock (&self->pv->outgoing_lock);
+}
+
 static void
 keepalive_stop_timeout (ChimeWebsocketConnection *self)
 {
@@ -326,35 +480,99 @@ xor_with_mask (const guint8 *mask,
 	       guint8 *data,
 	       gsize len)
 {
-	gsize n;
+	/* Do the masking, as many bytes at a time as this CPU can */
+	chime_websocket_mask (mask, data, len);
+}
+
+static GByteArray *
+deflate_message (ChimeWebsocketConnectionPrivate *pv,
+		 const GOutputVector *vectors,
+		 guint n_vectors,
+		 gsize length)
+{
+	z_stream *z = pv->deflater;
+	GByteArray *out = g_byte_array_sized_new (length / 2 + 64);
+	gsize chunk = MAX (1024, length / 4);
+	guint i;
+
+	for (i = 0; i < n_vectors; i++) {
+		int flush = (i == n_vectors - 1) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+		z->next_in = (Bytef *)vectors[i].buffer;
+		z->avail_in = vectors[i].size;
+		do {
+			gsize have = out->len;
+
+			g_byte_array_set_size (out, have + chunk);
+			z->next_out = out->data + have;
+			z->avail_out = chunk;
+			if (deflate (z, flush) == Z_STREAM_ERROR) {
+				deflateReset (z);
+				g_byte_array_unref (out);
+				return NULL;
+			}
+			g_byte_array_set_size (out, have + chunk - z->avail_out);
+		} while (z->avail_out == 0);
+	}
 
-	/* Do the masking */
-	for (n = 0; n < len; n++)
-		data[n] ^= mask[n & 3];
+	/* The sync flush leaves an empty stored block, 00 00 ff ff, on the
+	 * end which the peer puts back before inflating */
+	g_assert (out->len >= 4);
+	g_byte_array_set_size (out, out->len - 4);
+
+	if (pv->deflate_reset)
+		deflateReset (z);
+	return out;
 }
 
 static void
-send_message (ChimeWebsocketConnection *self,
-	      ChimeWebsocketQueueFlags flags,
-	      guint8 opcode,
-	      const guint8 *data,
-	      gsize length)
+send_message_iov (ChimeWebsocketConnection *self,
+		  ChimeWebsocketQueueFlags flags,
+		  guint8 opcode,
+		  const GOutputVector *vectors,
+		  guint n_vectors)
 {
-	gsize buffered_amount = length;
+	ChimeWebsocketConnectionPrivate *pv = self->pv;
+	gsize buffered_amount;
+	gsize length = 0;
+	GByteArray *compressed = NULL;
+	GOutputVector cvector;
 	GByteArray *bytes;
 	gsize frame_len;
 	guint8 *outer;
 	guint8 *mask = 0;
 	guint8 *at;
+	gsize done;
+	guint i;
 
 	if (!(chime_websocket_connection_get_state (self) == SOUP_WEBSOCKET_STATE_OPEN)) {
 		g_debug ("Ignoring message since the connection is closed or is closing");
 		return;
 	}
 
+	for (i = 0; i < n_vectors; i++)
+		length += vectors[i].size;
+	buffered_amount = length;
+
+	if (!(opcode & 0x08)) {
+		pv->raw_out += length;
+		if (pv->deflater && length >= DEFLATE_MIN_SIZE)
+			compressed = deflate_message (pv, vectors, n_vectors, length);
+		if (compressed) {
+			cvector.buffer = compressed->data;
+			cvector.size = compressed->len;
+			vectors = &cvector;
+			n_vectors = 1;
+			length = compressed->len;
+		}
+		pv->wire_out += length;
+	}
+
 	bytes = g_byte_array_sized_new (14 + length);
 	outer = bytes->data;
 	outer[0] = 0x80 | opcode;
+	if (compressed)
+		outer[0] |= 0x40; /* RSV1 */
 
 	/* If control message, truncate payload */
 	if (opcode & 0x08) {
@@ -401,16 +619,39 @@ send_message (ChimeWebsocketConnection *self,
 		bytes->len += 4;
 	}
 
+	/* Copy the payload straight into place after the header, masking it
+	 * on the way if we need to, so it is only copied once */
 	at = bytes->data + bytes->len;
-	g_byte_array_append (bytes, data, length);
+	for (i = 0, done = 0; i < n_vectors && done < length; i++) {
+		gsize n = MIN (vectors[i].size, length - done);
+
+		if (mask)
+			chime_websocket_mask_copy (mask, done, at + done, vectors[i].buffer, n);
+		else
+			memcpy (at + done, vectors[i].buffer, n);
+		done += n;
+	}
+	bytes->len += length;
 
-	if (self->pv->connection_type == SOUP_WEBSOCKET_CONNECTION_CLIENT)
-		xor_with_mask (mask, at, length);
+	if (compressed)
+		g_byte_array_unref (compressed);
 
 	frame_len = bytes->len;
 	queue_frame (self, flags, g_byte_array_free (bytes, FALSE),
 		     frame_len, buffered_amount);
-	g_debug ("queued %d frame of len %u", (int)opcode, (guint)frame_len);
+	CHIME_TRACE ("queued %d frame of len %u\n", (int)opcode, (guint)frame_len);
+}
+
+static void
+send_message (ChimeWebsocketConnection *self,
+	      ChimeWebsocketQueueFlags flags,
+	      guint8 opcode,
+	      const guint8 *data,
+	      gsize length)
+{
+	GOutputVector vector = { data, length };
+
+	send_message_iov (self, flags, opcode, &vector, 1);
 }
 
 static void
@@ -654,10 +895,114 @@ receive_pong (ChimeWebsocketConnection *self,
 	g_bytes_unref (bytes);
 }
 
+/* Returns NULL if the data is corrupt, or (setting *too_big) if it would
+ * inflate to more than max_incoming_payload_size */
+static GByteArray *
+inflate_message (ChimeWebsocketConnectionPrivate *pv,
+		 GByteArray *data,
+		 gboolean *too_big)
+{
+	static const guint8 tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	z_stream *z = pv->inflater;
+	guint64 limit = pv->max_incoming_payload_size;
+	GByteArray *out = g_byte_array_sized_new (data->len * 4 + 1);
+	gboolean ended = FALSE;
+	int ret = Z_OK;
+	int pass;
+
+	*too_big = FALSE;
+	for (pass = 0; pass < 2 && !ended; pass++) {
+		z->next_in = pass ? (Bytef *)tail : data->data;
+		z->avail_in = pass ? sizeof (tail) : data->len;
+
+		do {
+			gsize have = out->len;
+			gsize room = MAX (4096, have);
+
+			/* Never inflate more than one byte past the limit,
+			 * which is enough to tell that it was exceeded */
+			if (limit > 0)
+				room = MIN (room, limit + 1 - have);
+
+			g_byte_array_set_size (out, have + room);
+			z->next_out = out->data + have;
+			z->avail_out = room;
+			ret = inflate (z, Z_SYNC_FLUSH);
+			g_byte_array_set_size (out, have + room - z->avail_out);
+
+			if (limit > 0 && out->len > limit) {
+				*too_big = TRUE;
+				goto bad;
+			}
+
+			if (ret == Z_STREAM_END)
+				ended = TRUE;
+			else if (ret == Z_BUF_ERROR && z->avail_out)
+				break; /* Needs more input */
+			else if (ret != Z_OK && ret != Z_BUF_ERROR)
+				goto bad;
+		} while (!ended && (z->avail_in || !z->avail_out));
+	}
+
+	/* A final block ends the stream, and the next message starts a new one */
+	if (ended || pv->inflate_reset)
+		inflateReset (z);
+	return out;
+
+ bad:
+	inflateReset (z);
+	g_byte_array_unref (out);
+	return NULL;
+}
+
+/*
+ * Deliver a message which arrived in a single frame, which is nearly all
+ * of them, as a slice of the input buffer rather than a copy. The NUL we
+ * always put after a message, as a convenience, overwrites the start of
+ * the next frame while the signal is emitted; anyone keeping the message
+ * for later has to go by its length. If the message ends the data, the NUL
+ * goes in the byte process_incoming() reserved after it.
+ */
+static void
+deliver_in_place (ChimeWebsocketConnection *self,
+		  guint8 opcode,
+		  gconstpointer payload,
+		  gsize payload_len)
+{
+	ChimeWebsocketConnectionPrivate *pv = self->pv;
+	guint8 *after = (guint8 *)payload + payload_len;
+	GBytes *message;
+	guint8 saved;
+
+	if (opcode == 0x01 && !g_utf8_validate ((char *)payload, payload_len, NULL)) {
+		g_debug ("received invalid non-UTF8 text data");
+		bad_data_error_and_close (self);
+		return;
+	}
+
+	g_assert (after <= pv->incoming->array->data + pv->incoming->array->len);
+
+	pv->wire_in += payload_len;
+	pv->raw_in += payload_len;
+
+	/* The message keeps the buffer, and so @after, valid */
+	message = g_bytes_new_with_free_func (payload, payload_len, input_buffer_unref,
+					      input_buffer_ref (pv->incoming));
+	saved = *after;
+	*after = 0;
+
+	g_debug ("message: delivering %d with %d length", (int)opcode, (int)payload_len);
+	g_signal_emit (self, signals[MESSAGE], 0, (int)opcode, message);
+
+	*after = saved;
+	g_bytes_unref (message);
+}
+
 static void
 process_contents (ChimeWebsocketConnection *self,
 		  gboolean control,
 		  gboolean fin,
+		  gboolean compressed,
 		  guint8 opcode,
 		  gconstpointer payload,
 		  gsize payload_len)
@@ -665,6 +1010,14 @@ process_contents (ChimeWebsocketConnection *self,
 	ChimeWebsocketConnectionPrivate *pv = self->pv;
 	GBytes *message;
 
+	/* RSV1 is only allowed on the first frame of a data message, and
+	 * only if we negotiated permessage-deflate */
+	if (compressed && (control || !opcode || !pv->inflater)) {
+		g_debug ("received frame with unexpected RSV1 bit");
+		protocol_error_and_close (self);
+		return;
+	}
+
 	if (control) {
 		/* Control frames must never be fragmented */
 		if (!fin) {
@@ -673,7 +1026,7 @@ process_contents (ChimeWebsocketConnection *self,
 			return;
 		}
 
-		g_debug ("received control frame %d with %d payload", (int)opcode, (int)payload_len);
+		CHIME_TRACE ("received control frame %d with %d payload\n", (int)opcode, (int)payload_len);
 
 		switch (opcode) {
 		case 0x08:
@@ -701,7 +1054,7 @@ process_contents (ChimeWebsocketConnection *self,
 				protocol_error_and_close (self);
 				return;
 			}
-			g_debug ("received initial fragment frame %d with %d payload", (int)opcode, (int)payload_len);
+			CHIME_TRACE ("received initial fragment frame %d with %d payload\n", (int)opcode, (int)payload_len);
 		} else if (!fin && !opcode) {
 			/* Middle fragment of a message */
 			if (!pv->message_data) {
@@ -709,7 +1062,7 @@ process_contents (ChimeWebsocketConnection *self,
 				protocol_error_and_close (self);
 				return;
 			}
-			g_debug ("received middle fragment frame with %d payload", (int)payload_len);
+			CHIME_TRACE ("received middle fragment frame with %d payload\n", (int)payload_len);
 		} else if (fin && !opcode) {
 			/* Last fragment of a message */
 			if (!pv->message_data) {
@@ -717,7 +1070,7 @@ process_contents (ChimeWebsocketConnection *self,
 				protocol_error_and_close (self);
 				return;
 			}
-			g_debug ("received last fragment frame with %d payload", (int)payload_len);
+			CHIME_TRACE ("received last fragment frame with %d payload\n", (int)payload_len);
 		} else {
 			/* An unfragmented message */
 			g_assert (opcode != 0);
@@ -726,17 +1079,26 @@ process_contents (ChimeWebsocketConnection *self,
 				protocol_error_and_close (self);
 				return;
 			}
-			g_debug ("received frame %d with %d payload", (int)opcode, (int)payload_len);
+			CHIME_TRACE ("received frame %d with %d payload\n", (int)opcode, (int)payload_len);
+		}
+
+		if (fin && !compressed && (opcode == 0x01 || opcode == 0x02)) {
+			deliver_in_place (self, opcode, payload, payload_len);
+			return;
 		}
 
 		if (opcode) {
 			pv->message_opcode = opcode;
+			pv->message_compressed = compressed;
 			pv->message_data = g_byte_array_sized_new (payload_len + 1);
 		}
+		pv->wire_in += payload_len;
 
 		switch (pv->message_opcode) {
 		case 0x01:
-			if (!g_utf8_validate ((char *)payload, payload_len, NULL)) {
+			/* Compressed text is checked once it's inflated */
+			if (!pv->message_compressed &&
+			    !g_utf8_validate ((char *)payload, payload_len, NULL)) {
 				g_debug ("received invalid non-UTF8 text data");
 
 				/* Discard the entire message */
@@ -757,7 +1119,34 @@ process_contents (ChimeWebsocketConnection *self,
 		}
 
 		/* Actually deliver the message? */
+		if (fin && pv->message_compressed) {
+			GByteArray *inflated;
+			gboolean too_big;
+
+			inflated = inflate_message (pv, pv->message_data, &too_big);
+			g_byte_array_unref (pv->message_data);
+			pv->message_data = inflated;
+
+			if (!inflated ||
+			    (pv->message_opcode == 0x01 &&
+			     !g_utf8_validate ((char *)inflated->data, inflated->len, NULL))) {
+				g_debug ("received bad compressed message");
+				if (inflated)
+					g_byte_array_unref (inflated);
+				pv->message_data = NULL;
+				pv->message_opcode = 0;
+
+				if (too_big)
+					too_big_error_and_close (self, pv->max_incoming_payload_size);
+				else
+					bad_data_error_and_close (self);
+				return;
+			}
+		}
+
 		if (fin) {
+			pv->raw_in += pv->message_data->len;
+
 			/* Always null terminate, as a convenience */
 			g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
 
@@ -785,17 +1174,19 @@ process_frame (ChimeWebsocketConnection *self)
 	guint8 *mask;
 	gboolean fin;
 	gboolean control;
+	gboolean compressed;
 	gboolean masked;
 	guint8 opcode;
 	gsize len;
 	gsize at;
 
-	len = self->pv->incoming->len;
+	len = self->pv->incoming->array->len - self->pv->incoming_start;
 	if (len < 2)
 		return FALSE; /* need more data */
 
-	header = self->pv->incoming->data;
+	header = self->pv->incoming->array->data + self->pv->incoming_start;
 	fin = ((header[0] & 0x80) != 0);
+	compressed = ((header[0] & 0x40) != 0);
 	control = header[0] & 0x08;
 	opcode = header[0] & 0x0f;
 	masked = ((header[1] & 0x80) != 0);
@@ -853,18 +1244,58 @@ process_frame (ChimeWebsocketConnection *self)
 	/* Note that now that we've unmasked, we've modified the buffer, we can
 	 * only return below via discarding or processing the message
 	 */
-	process_contents (self, control, fin, opcode, payload, payload_len);
+	process_contents (self, control, fin, compressed, opcode, payload, payload_len);
 
-	/* Move past the parsed frame */
-	g_byte_array_remove_range (self->pv->incoming, 0, at + payload_len);
+	/* Move past the parsed frame. The space is reclaimed once we've
+	 * processed all the frames we can, in compact_incoming() */
+	self->pv->incoming_start += at + payload_len;
 	return TRUE;
 }
 
+static void
+compact_incoming (ChimeWebsocketConnectionPrivate *pv)
+{
+	GByteArray *array = pv->incoming->array;
+	gsize left = array->len - pv->incoming_start;
+
+	if (input_buffer_lent (pv->incoming)) {
+		/* Someone kept a message, so leave the buffer to them and
+		 * start a new one with whatever is left over */
+		InputBuffer *ib = input_buffer_new (MAX (left, READ_SIZE_MIN));
+
+		g_byte_array_append (ib->array, array->data + pv->incoming_start, left);
+		input_buffer_unref (pv->incoming);
+		pv->incoming = ib;
+	} else if (!left && array->len > 4 * READ_SIZE_MAX) {
+		/* Don't keep the memory from one huge message forever */
+		input_buffer_unref (pv->incoming);
+		pv->incoming = input_buffer_new (READ_SIZE_MIN);
+	} else if (pv->incoming_start >= left) {
+		/* Only move a partial frame down when that frees at least as
+		 * much space as it copies, so the copying stays linear in the
+		 * amount of data received however big the frame is */
+		memmove (array->data, array->data + pv->incoming_start, left);
+		array->len = left;
+	} else {
+		return;
+	}
+	pv->incoming_start = 0;
+}
+
 static void
 process_incoming (ChimeWebsocketConnection *self)
 {
+	GByteArray *array = self->pv->incoming->array;
+
+	/* Make sure there is room for the NUL deliver_in_place() puts after
+	 * a message which ends exactly at the end of the data */
+	g_byte_array_set_size (array, array->len + 1);
+	array->len--;
+
 	while (process_frame (self))
 		;
+
+	compact_incoming (self->pv);
 }
 
 static gboolean
@@ -875,22 +1306,24 @@ on_web_socket_input (GObject *pollable_stream,
 	ChimeWebsocketConnectionPrivate *pv = self->pv;
 	GError *error = NULL;
 	gboolean end = FALSE;
+	GByteArray *array = pv->incoming->array;
 	gssize count;
 	gsize len;
 
 	do {
-		len = pv->incoming->len;
-		g_byte_array_set_size (pv->incoming, len + 1024);
+		len = array->len;
+		g_byte_array_set_size (array, len + pv->read_size);
 
 		count = g_pollable_input_stream_read_nonblocking (pv->input,
-								  pv->incoming->data + len,
-								  1024, NULL, &error);
+								  array->data + len,
+								  pv->read_size, NULL, &error);
 
 		if (count < 0) {
 			if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
 				g_error_free (error);
 				count = 0;
 			} else {
+				array->len = len;
 				emit_error_and_close (self, error, TRUE);
 				return TRUE;
 			}
@@ -898,7 +1331,12 @@ on_web_socket_input (GObject *pollable_stream,
 			end = TRUE;
 		}
 
-		pv->incoming->len = len + count;
+		array->len = len + count;
+
+		if ((gsize)count == pv->read_size && pv->read_size < READ_SIZE_MAX)
+			pv->read_size *= 2;
+		else if (count > 0 && (gsize)count < pv->read_size / 4 && pv->read_size > READ_SIZE_MIN)
+			pv->read_size /= 2;
 	} while (count > 0);
 
 	process_incoming (self);
@@ -923,10 +1361,16 @@ on_web_socket_output (GObject *pollable_stream,
 {
 	ChimeWebsocketConnection *self = CHIME_WEBSOCKET_CONNECTION (user_data);
 	ChimeWebsocketConnectionPrivate *pv = self->pv;
+	GOutputVector vectors[MAX_WRITE_FRAMES];
+	guint n_vectors = 0;
+	gsize sent_amount;
+	gboolean sent_last = FALSE;
+	gboolean crossed;
 	const guint8 *data;
 	GError *error = NULL;
 	Frame *frame;
-	gssize count;
+	GList *l;
+	gsize count;
 	gsize len;
 
 	if (chime_websocket_connection_get_state (self) == SOUP_WEBSOCKET_STATE_CLOSED) {
@@ -935,52 +1379,107 @@ on_web_socket_output (GObject *pollable_stream,
 		return TRUE;
 	}
 
+	/* Held across the write, so nothing can be queued ahead of the
+	 * frames it covers before they are accounted for below */
+	g_mutex_lock (&pv->outgoing_lock);
+
 	frame = g_queue_peek_head (&pv->outgoing);
 
 	/* No more frames to send */
 	if (frame == NULL) {
-		stop_output (self);
+		stop_output_locked (self);
+		g_mutex_unlock (&pv->outgoing_lock);
 		return TRUE;
 	}
 
-	data = g_bytes_get_data (frame->data, &len);
-	g_assert (len > 0);
-	g_assert (len > frame->sent);
+	/* Gather as many queued frames as we can into one write, starting
+	 * with whatever is left of the one at the head. Nothing may follow
+	 * the last frame. */
+	for (l = pv->outgoing.head; l && n_vectors < MAX_WRITE_FRAMES; l = l->next) {
+		frame = l->data;
+		data = g_bytes_get_data (frame->data, &len);
+		g_assert (len > 0);
+		g_assert (len > frame->sent);
 
-	count = g_pollable_output_stream_write_nonblocking (pv->output,
-							    data + frame->sent,
-							    len - frame->sent,
-							    NULL, &error);
+		vectors[n_vectors].buffer = data + frame->sent;
+		vectors[n_vectors].size = len - frame->sent;
+		n_vectors++;
 
-	if (count < 0) {
-		if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
-			g_clear_error (&error);
-			count = 0;
-		} else {
-			emit_error_and_close (self, error, TRUE);
-			return FALSE;
-		}
+		if (frame->last)
+			break;
 	}
 
-	frame->sent += count;
-	if (frame->sent >= len) {
-		g_debug ("sent frame");
-		g_queue_pop_head (&pv->outgoing);
+#if GLIB_CHECK_VERSION(2, 60, 0)
+	switch (g_pollable_output_stream_writev_nonblocking (pv->output, vectors, n_vectors,
+							     &count, NULL, &error)) {
+	case G_POLLABLE_RETURN_OK:
+		break;
+	case G_POLLABLE_RETURN_WOULD_BLOCK:
+		count = 0;
+		break;
+	default:
+		g_mutex_unlock (&pv->outgoing_lock);
+		emit_error_and_close (self, error, TRUE);
+		return FALSE;
+	}
+#else
+	{
+		gssize ret = g_pollable_output_stream_write_nonblocking (pv->output,
+									 vectors[0].buffer,
+									 vectors[0].size,
+									 NULL, &error);
 
-		if (frame->last) {
-			if (pv->connection_type == SOUP_WEBSOCKET_CONNECTION_SERVER) {
-				close_io_stream (self);
+		if (ret < 0) {
+			if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+				g_clear_error (&error);
+				ret = 0;
 			} else {
-				shutdown_wr_io_stream (self);
-				close_io_after_timeout (self);
+				g_mutex_unlock (&pv->outgoing_lock);
+				emit_error_and_close (self, error, TRUE);
+				return FALSE;
 			}
 		}
+		count = ret;
+	}
+#endif
+
+	/* Account for what was written, which may end part way through
+	 * any of the frames */
+	sent_amount = 0;
+	while (count) {
+		frame = g_queue_peek_head (&pv->outgoing);
+		len = g_bytes_get_size (frame->data) - frame->sent;
+		if (count < len) {
+			frame->sent += count;
+			break;
+		}
+		count -= len;
+
+		CHIME_TRACE ("sent frame\n");
+		g_queue_pop_head (&pv->outgoing);
+		sent_amount += frame->amount;
+		if (frame->last)
+			sent_last = TRUE;
 		frame_free (frame);
 	}
 
+	crossed = sent_amount && account_buffered_amount (pv, 0, sent_amount);
+	g_mutex_unlock (&pv->outgoing_lock);
+
+	if (sent_last) {
+		if (pv->connection_type == SOUP_WEBSOCKET_CONNECTION_SERVER) {
+			close_io_stream (self);
+		} else {
+			shutdown_wr_io_stream (self);
+			close_io_after_timeout (self);
+		}
+	}
+	if (crossed)
+		water_mark_crossed (self);
 	return TRUE;
 }
 
+/* Called with outgoing_lock held */
 static void
 start_output (ChimeWebsocketConnection *self)
 {
@@ -1003,6 +1502,7 @@ queue_frame (ChimeWebsocketConnection *self,
 	     gsize amount)
 {
 	ChimeWebsocketConnectionPrivate *pv = self->pv;
+	gboolean crossed;
 	Frame *frame;
 	Frame *prev;
 
@@ -1016,6 +1516,8 @@ queue_frame (ChimeWebsocketConnection *self,
 	frame->amount = amount;
 	frame->last = (flags & CHIME_WEBSOCKET_QUEUE_LAST) ? TRUE : FALSE;
 
+	g_mutex_lock (&pv->outgoing_lock);
+
 	/* If urgent put at front of queue */
 	if (flags & CHIME_WEBSOCKET_QUEUE_URGENT) {
 		/* But we can't interrupt a message already partially sent */
@@ -1033,7 +1535,12 @@ queue_frame (ChimeWebsocketConnection *self,
 		g_queue_push_tail (&pv->outgoing, frame);
 	}
 
+	crossed = amount && account_buffered_amount (pv, amount, 0);
 	start_output (self);
+	g_mutex_unlock (&pv->outgoing_lock);
+
+	if (crossed)
+		water_mark_crossed (self);
 }
 
 static void
@@ -1105,6 +1612,22 @@ chime_websocket_connection_get_property (GObject *object,
 		g_value_set_uint (value, pv->keepalive_interval);
 		break;
 
+	case PROP_BUFFERED_AMOUNT:
+		g_value_set_uint64 (value, chime_websocket_connection_get_buffered_amount (self));
+		break;
+
+	case PROP_HIGH_WATER_MARK:
+		g_mutex_lock (&pv->outgoing_lock);
+		g_value_set_uint64 (value, pv->high_water_mark);
+		g_mutex_unlock (&pv->outgoing_lock);
+		break;
+
+	case PROP_LOW_WATER_MARK:
+		g_mutex_lock (&pv->outgoing_lock);
+		g_value_set_uint64 (value, pv->low_water_mark);
+		g_mutex_unlock (&pv->outgoing_lock);
+		break;
+
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1154,6 +1677,18 @@ chime_websocket_connection_set_property (GObject *object,
 		                                                  g_value_get_uint (value));
 		break;
 
+	case PROP_HIGH_WATER_MARK:
+		g_mutex_lock (&pv->outgoing_lock);
+		pv->high_water_mark = g_value_get_uint64 (value);
+		g_mutex_unlock (&pv->outgoing_lock);
+		break;
+
+	case PROP_LOW_WATER_MARK:
+		g_mutex_lock (&pv->outgoing_lock);
+		pv->low_water_mark = g_value_get_uint64 (value);
+		g_mutex_unlock (&pv->outgoing_lock);
+		break;
+
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1182,9 +1717,10 @@ chime_websocket_connection_finalize (GObject *object)
 	g_main_context_unref (pv->main_context);
 
 	if (pv->incoming)
-		g_byte_array_free (pv->incoming, TRUE);
+		input_buffer_unref (pv->incoming);
 	while (!g_queue_is_empty (&pv->outgoing))
 		frame_free (g_queue_pop_head (&pv->outgoing));
+	g_mutex_clear (&pv->outgoing_lock);
 
 	g_clear_object (&pv->io_stream);
 	g_assert (!pv->input_source);
@@ -1197,6 +1733,15 @@ chime_websocket_connection_finalize (GObject *object)
 	if (pv->message_data)
 		g_byte_array_free (pv->message_data, TRUE);
 
+	if (pv->deflater) {
+		deflateEnd (pv->deflater);
+		g_free (pv->deflater);
+	}
+	if (pv->inflater) {
+		inflateEnd (pv->inflater);
+		g_free (pv->inflater);
+	}
+
 	if (pv->uri)
 		soup_uri_free (pv->uri);
 	g_free (pv->origin);
@@ -1359,6 +1904,63 @@ chime_websocket_connection_class_init (ChimeWebsocketConnectionClass *klass)
 					                    G_PARAM_CONSTRUCT |
 					                    G_PARAM_STATIC_STRINGS));
 
+	/**
+	 * ChimeWebsocketConnection:buffered-amount:
+	 *
+	 * The number of bytes of data messages queued but not yet sent.
+	 * Control frames aren't counted. Since it changes with every frame,
+	 * and from whichever thread is sending, change notification is only
+	 * emitted in the main context when a water mark is crossed, along
+	 * with #ChimeWebsocketConnection::stalled or
+	 * #ChimeWebsocketConnection::writable.
+	 */
+	buffered_amount_pspec = g_param_spec_uint64 ("buffered-amount",
+						     "Buffered amount",
+						     "Bytes queued to be sent",
+						     0,
+						     G_MAXUINT64,
+						     0,
+						     G_PARAM_READABLE |
+						     G_PARAM_STATIC_STRINGS);
+	g_object_class_install_property (gobject_class, PROP_BUFFERED_AMOUNT,
+					 buffered_amount_pspec);
+
+	/**
+	 * ChimeWebsocketConnection:high-water-mark:
+	 *
+	 * #ChimeWebsocketConnection::stalled is emitted when
+	 * #ChimeWebsocketConnection:buffered-amount goes over this, or never
+	 * if it is 0.
+	 */
+	g_object_class_install_property (gobject_class, PROP_HIGH_WATER_MARK,
+					 g_param_spec_uint64 ("high-water-mark",
+							      "High water mark",
+							      "Buffered amount at which to stall",
+							      0,
+							      G_MAXUINT64,
+							      HIGH_WATER_MARK_DEFAULT,
+							      G_PARAM_READWRITE |
+							      G_PARAM_CONSTRUCT |
+							      G_PARAM_STATIC_STRINGS));
+
+	/**
+	 * ChimeWebsocketConnection:low-water-mark:
+	 *
+	 * #ChimeWebsocketConnection::writable is emitted when a stalled
+	 * connection's #ChimeWebsocketConnection:buffered-amount drains down
+	 * to this.
+	 */
+	g_object_class_install_property (gobject_class, PROP_LOW_WATER_MARK,
+					 g_param_spec_uint64 ("low-water-mark",
+							      "Low water mark",
+							      "Buffered amount at which to resume",
+							      0,
+							      G_MAXUINT64,
+							      LOW_WATER_MARK_DEFAULT,
+							      G_PARAM_READWRITE |
+							      G_PARAM_CONSTRUCT |
+							      G_PARAM_STATIC_STRINGS));
+
 	/**
 	 * ChimeWebsocketConnection::message:
 	 * @self: the WebSocket
@@ -1433,6 +2035,41 @@ chime_websocket_connection_class_init (ChimeWebsocketConnectionClass *klass)
 					NULL, NULL, g_cclosure_marshal_generic,
 					G_TYPE_NONE, 0);
 
+	/**
+	 * ChimeWebsocketConnection::stalled:
+	 * @self: the WebSocket
+	 *
+	 * Emitted when the data queued to be sent goes over
+	 * #ChimeWebsocketConnection:high-water-mark, because the peer or the
+	 * network can't keep up. Senders of data which goes stale, like video,
+	 * should hold back until #ChimeWebsocketConnection::writable.
+	 *
+	 * Like #ChimeWebsocketConnection::writable, this is emitted in the
+	 * connection's main context, even when the data was queued from
+	 * another thread.
+	 */
+	signals[STALLED] = g_signal_new ("stalled",
+					 CHIME_TYPE_WEBSOCKET_CONNECTION,
+					 G_SIGNAL_RUN_FIRST,
+					 0,
+					 NULL, NULL, g_cclosure_marshal_generic,
+					 G_TYPE_NONE, 0);
+
+	/**
+	 * ChimeWebsocketConnection::writable:
+	 * @self: the WebSocket
+	 *
+	 * Emitted after #ChimeWebsocketConnection::stalled, once the data
+	 * queued to be sent has drained down to
+	 * #ChimeWebsocketConnection:low-water-mark.
+	 */
+	signals[WRITABLE] = g_signal_new ("writable",
+					  CHIME_TYPE_WEBSOCKET_CONNECTION,
+					  G_SIGNAL_RUN_FIRST,
+					  0,
+					  NULL, NULL, g_cclosure_marshal_generic,
+					  G_TYPE_NONE, 0);
+
 	/**
 	 * ChimeWebsocketConnection::pong:
 	 * @self: the WebSocket
@@ -1705,6 +2342,31 @@ chime_websocket_connection_send_binary (ChimeWebsocketConnection *self,
 	send_message (self, CHIME_WEBSOCKET_QUEUE_NORMAL, 0x02, data, length);
 }
 
+/**
+ * chime_websocket_connection_send_binary_iov:
+ * @self: the WebSocket
+ * @vectors: (array length=n_vectors): the parts of the message
+ * @n_vectors: the number of elements in @vectors
+ *
+ * Send a binary message made up of the concatenation of @vectors to the
+ * peer, without the caller having to put it together first. The parts
+ * are copied (and masked) straight into the frame to be sent.
+ *
+ * The message is queued to be sent and will be sent when the main loop
+ * is run.
+ */
+void
+chime_websocket_connection_send_binary_iov (ChimeWebsocketConnection *self,
+					   const GOutputVector *vectors,
+					   guint n_vectors)
+{
+	g_return_if_fail (CHIME_IS_WEBSOCKET_CONNECTION (self));
+	g_return_if_fail (chime_websocket_connection_get_state (self) == SOUP_WEBSOCKET_STATE_OPEN);
+	g_return_if_fail (vectors != NULL || n_vectors == 0);
+
+	send_message_iov (self, CHIME_WEBSOCKET_QUEUE_NORMAL, 0x02, vectors, n_vectors);
+}
+
 /**
  * chime_websocket_connection_close:
  * @self: the WebSocket
@@ -1790,6 +2452,50 @@ chime_websocket_connection_set_max_incoming_payload_size (ChimeWebsocketConnecti
 	}
 }
 
+/**
+ * chime_websocket_connection_get_buffered_amount:
+ * @self: the WebSocket
+ *
+ * Gets the number of bytes of data messages queued but not yet sent.
+ *
+ * Returns: the buffered amount
+ */
+gsize
+chime_websocket_connection_get_buffered_amount (ChimeWebsocketConnection *self)
+{
+	gsize amount;
+
+	g_return_val_if_fail (CHIME_IS_WEBSOCKET_CONNECTION (self), 0);
+
+	g_mutex_lock (&self->pv->outgoing_lock);
+	amount = self->pv->buffered_amount;
+	g_mutex_unlock (&self->pv->outgoing_lock);
+
+	return amount;
+}
+
+/**
+ * chime_websocket_connection_set_water_marks:
+ * @self: the WebSocket
+ * @high: buffered amount over which to emit #ChimeWebsocketConnection::stalled,
+ *   or 0 never to
+ * @low: buffered amount at which to emit #ChimeWebsocketConnection::writable
+ *
+ * Sets the thresholds for signalling that data is being queued faster
+ * than it can be sent, and that it has caught up again.
+ */
+void
+chime_websocket_connection_set_water_marks (ChimeWebsocketConnection *self,
+					   gsize high,
+					   gsize low)
+{
+	g_return_if_fail (CHIME_IS_WEBSOCKET_CONNECTION (self));
+	g_return_if_fail (low <= high || !high);
+
+	g_object_set (self, "high-water-mark", (guint64)high,
+		      "low-water-mark", (guint64)low, NULL);
+}
+
 /**
  * chime_websocket_connection_get_keepalive_interval:
  * @self: the WebSocket
@@ -1858,4 +2564,235 @@ chime_websocket_connection_set_keepalive_interval (ChimeWebsocketConnection *sel
 	}
 }
 
+/* CHIME_WS_DEFLATE=0 turns compression off altogether,
+ * CHIME_WS_DEFLATE_BITS sets the window size (9-15, as a power of two) and
+ * CHIME_WS_DEFLATE_NO_CONTEXT asks for each message to be compressed
+ * separately, which saves the memory for the windows between messages at
+ * the cost of compressing less well. */
+static int
+deflate_window_bits (void)
+{
+	const char *env = g_getenv ("CHIME_WS_DEFLATE_BITS");
+	int bits = env ? atoi (env) : 15;
+
+	/* zlib can't do raw deflate with an 8-bit window */
+	return CLAMP (bits, 9, 15);
+}
+
+/* The window size we offered, on the handshake message, so that we can
+ * tell whether the server's answer is one to something we asked for. */
+#define DEFLATE_OFFER_KEY "chime-ws-deflate-bits"
+
+/**
+ * chime_websocket_offer_deflate:
+ * @msg: the #SoupMessage for the WebSocket handshake
+ *
+ * Offers the permessage-deflate extension to the server. This is for
+ * connections which carry text; there is no point on those carrying
+ * media, which is compressed already. If the server accepts, call
+ * chime_websocket_connection_accept_extensions() with @msg and its
+ * response.
+ */
+void
+chime_websocket_offer_deflate (SoupMessage *msg)
+{
+	const char *env = g_getenv ("CHIME_WS_DEFLATE");
+	GString *offer;
+	int bits;
+
+	if (env && !strcmp (env, "0"))
+		return;
+
+	bits = deflate_window_bits ();
+	offer = g_string_new ("permessage-deflate");
+	if (bits < 15)
+		g_string_append_printf (offer, "; client_max_window_bits=%d; server_max_window_bits=%d",
+					bits, bits);
+	else
+		g_string_append (offer, "; client_max_window_bits");
+	if (g_getenv ("CHIME_WS_DEFLATE_NO_CONTEXT"))
+		g_string_append (offer, "; client_no_context_takeover; server_no_context_takeover");
+
+	soup_message_headers_replace (msg->request_headers, "Sec-WebSocket-Extensions", offer->str);
+	g_string_free (offer, TRUE);
+	g_object_set_data (G_OBJECT (msg), DEFLATE_OFFER_KEY, GINT_TO_POINTER (bits));
+}
+
+static gboolean
+parse_window_bits (const char *value,
+		   int *bits)
+{
+	char *end;
+	long val;
+
+	if (!value)
+		return FALSE;
+	if (*value == '"')
+		value++;
+
+	val = strtol (value, &end, 10);
+	if (end == value || (*end && *end != '"') || val < 8 || val > 15)
+		return FALSE;
+
+	*bits = val;
+	return TRUE;
+}
+
+enum {
+	PARAM_SERVER_NO_CONTEXT = 1 << 0,
+	PARAM_CLIENT_NO_CONTEXT = 1 << 1,
+	PARAM_SERVER_BITS = 1 << 2,
+	PARAM_CLIENT_BITS = 1 << 3,
+};
+
+/**
+ * chime_websocket_connection_accept_extensions:
+ * @self: the WebSocket
+ * @msg: the #SoupMessage for the WebSocket handshake
+ * @extensions: (allow-none): the server's Sec-WebSocket-Extensions header
+ * @error: return location for a #GError
+ *
+ * Sets up the extensions the server accepted from those offered by
+ * chime_websocket_offer_deflate() on @msg. Fails if it accepted something
+ * which wasn't offered, or answered with parameters which don't fit the
+ * offer, in which case the connection can't be used.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+chime_websocket_connection_accept_extensions (ChimeWebsocketConnection *self,
+					     SoupMessage *msg,
+					     const char *extensions,
+					     GError **error)
+{
+	ChimeWebsocketConnectionPrivate *pv;
+	int offered_bits, deflate_bits, inflate_bits = 15;
+	gboolean deflate_reset = FALSE, inflate_reset = FALSE;
+	gchar **exts, **params;
+	guint seen = 0;
+	gboolean ok = FALSE;
+	int i;
+
+	g_return_val_if_fail (CHIME_IS_WEBSOCKET_CONNECTION (self), FALSE);
+	g_return_val_if_fail (SOUP_IS_MESSAGE (msg), FALSE);
+	pv = self->pv;
+	g_return_val_if_fail (pv->deflater == NULL, FALSE);
+
+	if (!extensions || !*extensions)
+		return TRUE;
+
+	/* Nothing may be accepted which wasn't offered (RFC 7692 §5) */
+	offered_bits = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (msg), DEFLATE_OFFER_KEY));
+	deflate_bits = offered_bits;
+
+	exts = g_strsplit (extensions, ",", 0);
+	if (!offered_bits || g_strv_length (exts) != 1)
+		goto out;
+
+	params = g_strsplit (exts[0], ";", 0);
+	if (strcmp (g_strstrip (params[0]), "permessage-deflate"))
+		goto out_params;
+
+	for (i = 1; params[i]; i++) {
+		char *value = strchr (params[i], '=');
+
+		if (value) {
+			*value++ = 0;
+			value = g_strstrip (value);
+		}
+		g_strstrip (params[i]);
+
+		if (!strcmp (params[i], "server_no_context_takeover") && !value) {
+			if (seen & PARAM_SERVER_NO_CONTEXT)
+				goto out_params;
+			seen |= PARAM_SERVER_NO_CONTEXT;
+			inflate_reset = TRUE;
+		} else if (!strcmp (params[i], "client_no_context_takeover") && !value) {
+			if (seen & PARAM_CLIENT_NO_CONTEXT)
+				goto out_params;
+			seen |= PARAM_CLIENT_NO_CONTEXT;
+			deflate_reset = TRUE;
+		} else if (!strcmp (params[i], "server_max_window_bits")) {
+			if (seen & PARAM_SERVER_BITS)
+				goto out_params;
+			seen |= PARAM_SERVER_BITS;
+			if (!parse_window_bits (value, &inflate_bits) ||
+			    inflate_bits > offered_bits)
+				goto out_params;
+		} else if (!strcmp (params[i], "client_max_window_bits")) {
+			if (seen & PARAM_CLIENT_BITS)
+				goto out_params;
+			seen |= PARAM_CLIENT_BITS;
+			/* zlib can't compress with an 8-bit window, and we
+			 * mustn't use a bigger one than the server allows */
+			if (!parse_window_bits (value, &deflate_bits) ||
+			    deflate_bits < 9 || deflate_bits > offered_bits)
+				goto out_params;
+		} else {
+			goto out_params;
+		}
+	}
+
+	pv->deflater = g_new0 (z_stream, 1);
+	if (deflateInit2 (pv->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			  -deflate_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		g_clear_pointer (&pv->deflater, g_free);
+		goto out_params;
+	}
+	pv->inflater = g_new0 (z_stream, 1);
+	if (inflateInit2 (pv->inflater, -MAX (inflate_bits, 9)) != Z_OK) {
+		deflateEnd (pv->deflater);
+		g_clear_pointer (&pv->deflater, g_free);
+		g_clear_pointer (&pv->inflater, g_free);
+		goto out_params;
+	}
+	pv->deflate_reset = deflate_reset;
+	pv->inflate_reset = inflate_reset;
+	g_debug ("permessage-deflate: window bits %d/%d, context takeover %s/%s",
+		 deflate_bits, inflate_bits, deflate_reset ? "no" : "yes",
+		 inflate_reset ? "no" : "yes");
+	ok = TRUE;
+
+ out_params:
+	g_strfreev (params);
+ out:
+	g_strfreev (exts);
+	if (!ok)
+		g_set_error (error, SOUP_WEBSOCKET_ERROR, SOUP_WEBSOCKET_ERROR_BAD_HANDSHAKE,
+			     "Server accepted unsupported WebSocket extensions: %s", extensions);
+	return ok;
+}
+
+/**
+ * chime_websocket_connection_get_deflate_stats:
+ * @self: the WebSocket
+ * @raw_out: (out): bytes of data messages sent
+ * @wire_out: (out): what they came to after compression
+ * @raw_in: (out): bytes of data messages received
+ * @wire_in: (out): what they came to before decompression
+ *
+ * Gets the totals for working out how much permessage-deflate is saving.
+ * Control frames aren't counted.
+ *
+ * Returns: %TRUE if permessage-deflate was negotiated
+ */
+gboolean
+chime_websocket_connection_get_deflate_stats (ChimeWebsocketConnection *self,
+					     guint64 *raw_out,
+					     guint64 *wire_out,
+					     guint64 *raw_in,
+					     guint64 *wire_in)
+{
+	ChimeWebsocketConnectionPrivate *pv;
+
+	g_return_val_if_fail (CHIME_IS_WEBSOCKET_CONNECTION (self), FALSE);
+	pv = self->pv;
+
+	*raw_out = pv->raw_out;
+	*wire_out = pv->wire_out;
+	*raw_in = pv->raw_in;
+	*wire_in = pv->wire_in;
+	return pv->deflater != NULL;
+}
+
 #endif
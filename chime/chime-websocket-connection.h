@@ -89,6 +89,9 @@ void                chime_websocket_connection_send_text      (ChimeWebsocketCon
 void                chime_websocket_connection_send_binary    (ChimeWebsocketConnection *self,
 							      gconstpointer data,
 							      gsize length);
+void                chime_websocket_connection_send_binary_iov (ChimeWebsocketConnection *self,
+							       const GOutputVector *vectors,
+							       guint n_vectors);
 
 void                chime_websocket_connection_close          (ChimeWebsocketConnection *self,
 							      gushort code,
@@ -104,6 +107,25 @@ guint               chime_websocket_connection_get_keepalive_interval (ChimeWebs
 void                chime_websocket_connection_set_keepalive_interval (ChimeWebsocketConnection *self,
                                                                       guint                    interval);
 
+gsize               chime_websocket_connection_get_buffered_amount (ChimeWebsocketConnection *self);
+
+void                chime_websocket_connection_set_water_marks (ChimeWebsocketConnection *self,
+                                                               gsize                    high,
+                                                               gsize                    low);
+
+void                chime_websocket_offer_deflate             (SoupMessage *msg);
+
+gboolean            chime_websocket_connection_accept_extensions (ChimeWebsocketConnection *self,
+								 SoupMessage *msg,
+								 const char *extensions,
+								 GError **error);
+
+gboolean            chime_websocket_connection_get_deflate_stats (ChimeWebsocketConnection *self,
+								 guint64 *raw_out,
+								 guint64 *wire_out,
+								 guint64 *raw_in,
+								 guint64 *wire_in);
+
 
 G_END_DECLS
 
@@ -0,0 +1,227 @@
+/*
+ * Pidgin/libpurple Chime client plugin
+ *
+ * Copyright © 2017 Amazon.com, Inc. or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * WebSocket payload masking. Every byte of every frame we send is masked
+ * (RFC 6455 §5.3), which for screen sharing is a lot of bytes, so do it a
+ * vector or at least a machine word at a time.
+ *
+ * The mask repeats every four bytes and each block size below is a
+ * multiple of four, so each stage can start with the mask at offset zero
+ * and hand the remainder on to the next, narrower, one. Each stage reads
+ * from @src and writes to @dst, which may be the same, so that a payload
+ * can be masked as it is copied into a frame. Loads and stores
+ * are all unaligned; that costs nothing on anything we care about, and
+ * the payload inside a frame is rarely aligned anyway.
+ */
+
+#include "chime-websocket-mask.h"
+#include "chime-log.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_MASK_AVX2
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* Each of these takes a 32-byte copy of the mask and returns how many
+ * bytes it did, which is a multiple of its block size. */
+typedef gsize (*mask_func)(const guint8 *pat, guint8 *dst, const guint8 *src, gsize len);
+
+static gsize mask_words(const guint8 *pat, guint8 *dst, const guint8 *src, gsize len)
+{
+	guint64 m, v;
+	gsize n;
+
+	memcpy(&m, pat, sizeof(m));
+	for (n = 0; n + 8 <= len; n += 8) {
+		memcpy(&v, src + n, sizeof(v));
+		v ^= m;
+		memcpy(dst + n, &v, sizeof(v));
+	}
+	return n;
+}
+
+#if defined(__SSE2__)
+static gsize mask_sse2(const guint8 *pat, guint8 *dst, const guint8 *src, gsize len)
+{
+	__m128i m = _mm_loadu_si128((const __m128i *)pat);
+	gsize n;
+
+	for (n = 0; n + 16 <= len; n += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + n));
+		_mm_storeu_si128((__m128i *)(dst + n), _mm_xor_si128(v, m));
+	}
+	return n;
+}
+#endif
+
+#ifdef HAVE_MASK_AVX2
+__attribute__((target("avx2")))
+static gsize mask_avx2(const guint8 *pat, guint8 *dst, const guint8 *src, gsize len)
+{
+	__m256i m = _mm256_loadu_si256((const __m256i *)pat);
+	gsize n;
+
+	for (n = 0; n + 32 <= len; n += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + n));
+		_mm256_storeu_si256((__m256i *)(dst + n), _mm256_xor_si256(v, m));
+	}
+	return n;
+}
+
+static gboolean have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static gsize mask_neon(const guint8 *pat, guint8 *dst, const guint8 *src, gsize len)
+{
+	uint8x16_t m = vld1q_u8(pat);
+	gsize n;
+
+	for (n = 0; n + 16 <= len; n += 16)
+		vst1q_u8(dst + n, veorq_u8(vld1q_u8(src + n), m));
+	return n;
+}
+#endif
+
+struct mask_impl {
+	const gchar *name;
+	mask_func func;		/* NULL for words, or bytes */
+	gboolean words;
+};
+
+/* Slowest first */
+static const struct mask_impl all_impls[] = {
+	{ "bytes", NULL, FALSE },
+	{ "words", NULL, TRUE },
+#if defined(__SSE2__)
+	{ "sse2", mask_sse2, TRUE },
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	{ "neon", mask_neon, TRUE },
+#endif
+#ifdef HAVE_MASK_AVX2
+	{ "avx2", mask_avx2, TRUE },
+#endif
+};
+
+static const gchar *usable_names[G_N_ELEMENTS(all_impls) + 1];
+static const struct mask_impl *usable[G_N_ELEMENTS(all_impls)];
+static guint nr_usable;
+static const struct mask_impl *best;
+
+static void init_impls(void)
+{
+	static gsize done;
+
+	if (!g_once_init_enter(&done))
+		return;
+
+	const gchar *want = g_getenv("CHIME_WS_MASK");
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(all_impls); i++) {
+#ifdef HAVE_MASK_AVX2
+		if (all_impls[i].func == mask_avx2 && !have_avx2())
+			continue;
+#endif
+		usable[nr_usable] = &all_impls[i];
+		usable_names[nr_usable++] = all_impls[i].name;
+	}
+
+	best = usable[nr_usable - 1];
+	for (i = 0; want && i < nr_usable; i++) {
+		if (!strcmp(want, usable[i]->name))
+			best = usable[i];
+	}
+	chime_debug("WebSocket masking with %s\n", best->name);
+
+	g_once_init_leave(&done, 1);
+}
+
+static void mask_impl(const struct mask_impl *impl, const guint8 *mask,
+		      guint8 *dst, const guint8 *src, gsize len)
+{
+	gsize n = 0;
+
+	if (impl->words && len >= 8) {
+		guint8 pat[32];
+		guint i;
+
+		for (i = 0; i < sizeof(pat); i++)
+			pat[i] = mask[i & 3];
+
+		if (impl->func)
+			n = impl->func(pat, dst, src, len);
+		n += mask_words(pat, dst + n, src + n, len - n);
+	}
+
+	for (; n < len; n++)
+		dst[n] = src[n] ^ mask[n & 3];
+}
+
+void chime_websocket_mask(const guint8 *mask, guint8 *data, gsize len)
+{
+	init_impls();
+	mask_impl(best, mask, data, data, len);
+}
+
+void chime_websocket_mask_copy(const guint8 *mask, gsize offset, guint8 *dst,
+			       const guint8 *src, gsize len)
+{
+	guint8 rot[4];
+	guint i;
+
+	for (i = 0; i < 4; i++)
+		rot[i] = mask[(offset + i) & 3];
+
+	init_impls();
+	mask_impl(best, rot, dst, src, len);
+}
+
+const gchar * const *chime_websocket_mask_impls(void)
+{
+	init_impls();
+	return usable_names;
+}
+
+gboolean chime_websocket_mask_with(const gchar *impl, const guint8 *mask,
+				   guint8 *data, gsize len)
+{
+	guint i;
+
+	init_impls();
+	for (i = 0; i < nr_usable; i++) {
+		if (!strcmp(impl, usable[i]->name)) {
+			mask_impl(usable[i], mask, data, data, len);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
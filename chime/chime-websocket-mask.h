@@ -0,0 +1,41 @@
+/*
+ * Pidgin/libpurple Chime client plugin
+ *
+ * Copyright © 2017 Amazon.com, Inc. or its affiliates.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __CHIME_WEBSOCKET_MASK_H__
+#define __CHIME_WEBSOCKET_MASK_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* XOR @data in place with the 4-byte WebSocket @mask, starting at mask
+ * offset zero. Uses the fastest implementation this CPU has, unless
+ * CHIME_WS_MASK names another one. */
+void chime_websocket_mask(const guint8 *mask, guint8 *data, gsize len);
+
+/* Copy @len bytes from @src to @dst, masking them as they go, for a part
+ * of a payload which starts @offset bytes in. */
+void chime_websocket_mask_copy(const guint8 *mask, gsize offset, guint8 *dst,
+			       const guint8 *src, gsize len);
+
+/* For chime-mask-bench: the implementations usable on this CPU, fastest
+ * last, and a way to run a particular one. */
+const gchar * const *chime_websocket_mask_impls(void);
+gboolean chime_websocket_mask_with(const gchar *impl, const guint8 *mask,
+				   guint8 *data, gsize len);
+
+G_END_DECLS
+
+#endif /* __CHIME_WEBSOCKET_MASK_H__ */
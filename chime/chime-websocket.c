@@ -44,12 +44,19 @@ websocket_connect_async_stop (SoupMessage *msg, gpointer user_data)
 	ChimeConnection *cxn = CHIME_CONNECTION(g_task_get_task_data (task));
 	ChimeConnectionPrivate *priv = CHIME_CONNECTION_GET_PRIVATE (cxn);
 	GError *error = NULL;
+	gchar *extensions = NULL;
 
 	/* Disconnect websocket_connect_async_stop() handler. */
 	g_signal_handlers_disconnect_matched (msg, G_SIGNAL_MATCH_DATA,
 					      0, 0, NULL, NULL, task);
 
 	g_object_ref(msg);
+#ifndef USE_LIBSOUP_WEBSOCKETS
+	/* libsoup rejects any extensions at all, so deal with them ourselves */
+	extensions = g_strdup (soup_message_headers_get_one (msg->response_headers,
+							     "Sec-WebSocket-Extensions"));
+	soup_message_headers_remove (msg->response_headers, "Sec-WebSocket-Extensions");
+#endif
 	if (soup_websocket_client_verify_handshake (msg, &error)) {
 		GIOStream *stream = soup_session_steal_connection (priv->soup_sess, msg);
 		SoupWebsocketConnection *client = soup_websocket_connection_new (stream,
@@ -59,10 +66,18 @@ websocket_connect_async_stop (SoupMessage *msg, gpointer user_data)
 				 soup_message_headers_get_one (msg->response_headers, "Sec-WebSocket-Protocol"));
 		g_object_unref (stream);
 
+#ifndef USE_LIBSOUP_WEBSOCKETS
+		if (!chime_websocket_connection_accept_extensions (client, msg, extensions, &error)) {
+			chime_websocket_connection_close (client, SOUP_WEBSOCKET_CLOSE_PROTOCOL_ERROR, NULL);
+			g_object_unref (client);
+			g_task_return_error (task, error);
+		} else
+#endif
 		g_task_return_pointer (task, client, g_object_unref);
 	} else
 		g_task_return_error (task, error);
 
+	g_free (extensions);
 	g_object_unref (msg);
 	g_object_unref (task);
 }
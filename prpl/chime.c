@@ -155,6 +155,21 @@ static void on_chime_log_message(ChimeConnection *cxn, ChimeLogLevel lvl, const
 	purple_debug(purple_level_from_chime(lvl), "chime", "%s", str);
 }
 
+/* The library doesn't format its chattier messages unless asked to, so
+ * only ask if there's a debug log for them to go to. This is checked at
+ * login, so opening the debug window later needs a reconnect to see them. */
+static ChimeLogLevel wanted_log_level(void)
+{
+	PurpleDebugUiOps *ops = purple_debug_get_ui_ops();
+
+	if (purple_debug_is_enabled() ||
+	    (ops && ops->print &&
+	     (!ops->is_enabled || ops->is_enabled(PURPLE_DEBUG_MISC, "chime"))))
+		return CHIME_LOGLVL_MISC;
+
+	return CHIME_LOGLVL_INFO;
+}
+
 static void on_session_token_changed(ChimeConnection *connection, GParamSpec *pspec, PurpleConnection *conn)
 {
 	purple_debug(PURPLE_DEBUG_INFO, "chime", "Session token changed\n");
@@ -251,6 +266,7 @@ static void chime_purple_login(PurpleAccount *account)
 	   on close, and it doesn't use it anyway. */
 	g_signal_connect(pc->cxn, "log-message",
 			 G_CALLBACK(on_chime_log_message), NULL);
+	chime_connection_set_log_level(pc->cxn, wanted_log_level());
 
 	chime_connection_connect(pc->cxn);
 }